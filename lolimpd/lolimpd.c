@@ -8,6 +8,15 @@
 #include <unistd.h>
 #include <limits.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <mpd/client.h>
 
 /* really dirty code :)
@@ -15,10 +24,27 @@
  * will cleanup when I feel like it. */
 
 #define MPD_TIMEOUT 3000
+#define RECONNECT_MAX 30 /* longest wait in seconds between watch reconnects */
 #define MPD_OUTPUT_BUFFER 16384
+#define COVER_THREADS 4   /* cover art lookups running while songs are received */
+#define COVER_WINDOW 256  /* songs received ahead of the oldest unprinted one */
 #define MUSIC_DIR "/mnt/東方/music"
 #define SEPERATOR " >> "
+#define FOLD_KANA 1 /* match katakana and hiragana as same */
+#define DB_CACHE "/tmp/lolimpd.db"
+#define DB_MAGIC "lolimpd-db 2"
+#define QUEUE_CACHE "/tmp/lolimpd.queue"
+#define QUEUE_MAGIC "lolimpd-queue 2"
+#define COVER_CACHE "/tmp/lolimpd-covers"
+#define COVER_MAX (16*1024*1024) /* largest embedded cover extracted */
+#define TAG_READ_MAX (64*1024)   /* most read at once to parse tag headers */
 #define ARG_WITH_COVER "--with-cover"
+#define ARG_STATS "--stats"
+#define ARG_FORMAT "--format"
+#define ARG_SORT "--sort"
+#define ARG_GROUP_BY "--group-by"
+#define ARG_FORCE "--force"
+#define SORT_KEYS_MAX 8
 
 #define _D "\1-\2!\1-\5"
 #define ERR_SNTX _D" \3%d \2[\4%s \5:: \4%s\2]\5:"
@@ -37,6 +63,8 @@
          mpd_connection_get_error(mpd->connection) != MPD_ERROR_SUCCESS)   \
       ERR("MPD error: (%d) %s", mpd_connection_get_error(mpd->connection), \
             mpd_connection_get_error_message(mpd->connection));
+#define STAT(x) __atomic_add_fetch(&stats.x, 1, __ATOMIC_RELAXED);
+#define MPDRT(x) (++stats.roundtrips, (x))
 
 /* files are not loaded, if playlist found from same directory */
 static const char *fileFormats[] = {
@@ -48,6 +76,173 @@ static const char *playlistFormats[] = {
    ".cue", ".m3u", ".pls", NULL
 };
 
+/* playlists sync reads as entry lists, cue sheets are not */
+static const char *syncFormats[] = {
+   ".m3u", ".m3u8", ".pls", NULL
+};
+
+/* output format op types */
+enum {
+   FMT_END,
+   FMT_LITERAL,
+   FMT_TAG,
+   FMT_ARTIST,
+   FMT_ALBUM,
+   FMT_TITLE,
+   FMT_FILE,
+};
+
+/* compiled output format op */
+typedef struct fmtop {
+   char type;
+   enum mpd_tag_type tag;
+   const char *str;
+   size_t len;
+} fmtop;
+
+/* %tag% names usable in --format */
+typedef struct fmttag {
+   const char *name;
+   char type;
+   enum mpd_tag_type tag;
+} fmttag;
+
+static const fmttag formatTags[] = {
+   { "artist",      FMT_ARTIST, MPD_TAG_ARTIST },
+   { "album",       FMT_ALBUM,  MPD_TAG_ALBUM },
+   { "title",       FMT_TITLE,  MPD_TAG_TITLE },
+   { "file",        FMT_FILE,   MPD_TAG_UNKNOWN },
+   { "track",       FMT_TAG,    MPD_TAG_TRACK },
+   { "disc",        FMT_TAG,    MPD_TAG_DISC },
+   { "date",        FMT_TAG,    MPD_TAG_DATE },
+   { "genre",       FMT_TAG,    MPD_TAG_GENRE },
+   { "albumartist", FMT_TAG,    MPD_TAG_ALBUM_ARTIST },
+   { "composer",    FMT_TAG,    MPD_TAG_COMPOSER },
+   { "performer",   FMT_TAG,    MPD_TAG_PERFORMER },
+   { "comment",     FMT_TAG,    MPD_TAG_COMMENT },
+   { "name",        FMT_TAG,    MPD_TAG_NAME },
+   { NULL,          FMT_END,    MPD_TAG_UNKNOWN },
+};
+
+/* --format, NULL means the default artist >> album >> title */
+static fmtop *format = NULL;
+static unsigned long formatHash = 0;
+
+/* growable string */
+typedef struct strbuf {
+   char *data;
+   size_t len, size;
+} strbuf;
+
+/* search needle, normalized once per query */
+typedef struct mpdquery {
+   const char *needle;
+   char *key, *tokbuf;
+   char **tokens;
+   int tokc;
+} mpdquery;
+
+/* halfwidth katakana U+FF61..U+FF9F as fullwidth */
+static const unsigned short halfKana[] = {
+   0x3002, 0x300C, 0x300D, 0x3001, 0x30FB, 0x30F2, 0x30A1, 0x30A3,
+   0x30A5, 0x30A7, 0x30A9, 0x30E3, 0x30E5, 0x30E7, 0x30C3, 0x30FC,
+   0x30A2, 0x30A4, 0x30A6, 0x30A8, 0x30AA, 0x30AB, 0x30AD, 0x30AF,
+   0x30B1, 0x30B3, 0x30B5, 0x30B7, 0x30B9, 0x30BB, 0x30BD, 0x30BF,
+   0x30C1, 0x30C4, 0x30C6, 0x30C8, 0x30CA, 0x30CB, 0x30CC, 0x30CD,
+   0x30CE, 0x30CF, 0x30D2, 0x30D5, 0x30D8, 0x30DB, 0x30DE, 0x30DF,
+   0x30E0, 0x30E1, 0x30E2, 0x30E4, 0x30E6, 0x30E8, 0x30E9, 0x30EA,
+   0x30EB, 0x30EC, 0x30ED, 0x30EF, 0x30F3, 0x3099, 0x309A,
+};
+
+/* embedded picture found from audio file, either in file or memory */
+typedef struct embedcover {
+   off_t off;
+   size_t len;
+   unsigned char *mem;
+   int type; /* 3 is front cover */
+} embedcover;
+
+/* cover lookup slot states */
+enum {
+   SLOT_FREE,
+   SLOT_PENDING,
+   SLOT_RUNNING,
+   SLOT_DONE,
+   SLOT_SAME,
+};
+
+/* song waiting for its cover in listing */
+typedef struct coverslot {
+   char *line, *dir, *cover;
+   int state;
+} coverslot;
+
+/* cover lookup threads and reorder window */
+typedef struct coverpool {
+   pthread_mutex_t lock;
+   pthread_cond_t work, done;
+   coverslot slot[COVER_WINDOW];
+   size_t head, tail, next; /* oldest unprinted, next free, next to look up */
+   char *ldir, *lcover;
+   int threads, quit;
+} coverpool;
+
+/* ls --sort/--group-by keys, group key comes first */
+typedef struct sortspec {
+   const fmttag *key[SORT_KEYS_MAX];
+   int count, group;
+} sortspec;
+
+/* distinct strings stored once in arena, referred to by id */
+typedef struct strpool {
+   strbuf arena;
+   unsigned int *offset; /* id -> arena offset */
+   unsigned int *table;  /* hash -> id+1 */
+   unsigned int count, size, tsize;
+} strpool;
+
+/* tag dictionary of sorted listing, sort and group keys fold from these */
+enum {
+   DICT_ARTIST,
+   DICT_ALBUM,
+   DICT_ALBUMARTIST,
+   DICT_GENRE,
+   DICT_TAGS
+};
+
+static const fmttag dictTags[DICT_TAGS] = {
+   { "artist",      FMT_ARTIST, MPD_TAG_ARTIST },
+   { "album",       FMT_ALBUM,  MPD_TAG_ALBUM },
+   { "albumartist", FMT_TAG,    MPD_TAG_ALBUM_ARTIST },
+   { "genre",       FMT_TAG,    MPD_TAG_GENRE },
+};
+
+/* songs retained for sorted listing, one array per field */
+typedef struct sortlist {
+   sortspec spec;
+   strpool pool;
+   strbuf group, lines;
+   unsigned int *key[SORT_KEYS_MAX]; /* pool id, number for disc and track */
+   unsigned int *tag[DICT_TAGS];     /* pool id of raw tag value, only for tags in use */
+   unsigned int *fold;               /* pool id -> pool id of its sort key */
+   unsigned int *line, *gline, *dir, *pos; /* line is offset in lines, unique per song */
+   const fmtop *gfirst, *gend; /* --format ops rendering group label */
+   size_t count, size, nfold;
+   int printimg, dictused; /* bit per dictionary tag the keys need */
+} sortlist;
+
+/* callback for songs streamed from queue */
+typedef int (*mpdsongfunc)(const struct mpd_song *song, void *data);
+
+/* queue entry with its match key, from mpd or from queue cache */
+typedef struct queueentry {
+   unsigned int id, pos;
+   char *line, *key;
+} queueentry;
+
+/* callback for queue entries */
+typedef int (*mpdentryfunc)(const queueentry *entry, void *data);
+
 /* mpd server definition */
 typedef struct mpdserver {
    const unsigned int *version;
@@ -73,7 +268,7 @@ typedef struct mpdstate {
    unsigned int crossfade;
    unsigned int playmode;
    int volume;
-   int song;
+   int song, songpos;
    enum mpd_state state;
 } mpdstate;
 
@@ -89,6 +284,37 @@ typedef struct mpdclient {
 } mpdclient;
 static mpdclient *mpd = NULL;
 
+/* phases timed for --stats, time between marks goes to the marked phase */
+enum {
+   PHASE_CONNECT,
+   PHASE_RECEIVE, /* queue streamed or read from cache */
+   PHASE_COVER,   /* cover lookups waited on */
+   PHASE_SORT,    /* ranking and sorting of sorted listing */
+   PHASE_MIRROR,  /* database mirror sync */
+   PHASE_EDIT,    /* queue adds, deletes and moves */
+   PHASE_COMMAND, /* everything else the command does */
+   PHASE_QUIT,
+   PHASE_LAST
+};
+
+static const char *phaseNames[] = {
+   "connect", "receive", "cover", "sort", "mirror", "edit", "command", "quit", NULL
+};
+
+/* counters for --stats, always collected */
+typedef struct mpdstats {
+   unsigned long roundtrips;
+   unsigned long long songbytes;
+   unsigned long entities;
+   unsigned long matches;
+   unsigned long coverscans;
+   unsigned long coverhits;
+   unsigned long long phase[PHASE_LAST];
+   struct timespec mark;
+   int enabled;
+} mpdstats;
+static mpdstats stats;
+
 /* colors */
 static const char *colors[] = {
    "\33[31m", /* red */
@@ -123,6 +349,11 @@ REGISTER_OPT(opt_random);
 REGISTER_OPT(opt_single);
 REGISTER_OPT(opt_consume);
 REGISTER_OPT(opt_crossfade);
+REGISTER_OPT(opt_watch);
+REGISTER_OPT(opt_find);
+REGISTER_OPT(opt_keep);
+REGISTER_OPT(opt_drop);
+REGISTER_OPT(opt_sync);
 #undef REGISTER_OPT
 
 static const mpdopt opts[] = {
@@ -141,14 +372,173 @@ static const mpdopt opts[] = {
    { "single", 0, opt_single },
    { "consume", 0, opt_consume },
    { "crossfade", 1, opt_crossfade },
+   { "watch", 0, opt_watch },
+   { "find", 1, opt_find },
+   { "keep", 1, opt_keep },
+   { "drop", 1, opt_drop },
+   { "sync", 1, opt_sync },
    { NULL, 0, NULL },
 };
 
 enum {
    RETURN_OK,
    RETURN_FAIL,
+   RETURN_STOP, /* done early, not an error */
 };
 
+/* fnv-1a hash */
+static unsigned long _hash(const char *str) {
+   unsigned long hash = 2166136261UL;
+   for (; *str; ++str) hash = (hash ^ (unsigned char)*str) * 16777619UL;
+   return hash;
+}
+
+/* growable string buffer */
+static int sb_append(strbuf *sb, const char *str, size_t len) {
+   char *data;
+   size_t size;
+   if (sb->len+len+1 > sb->size) {
+      for (size = (sb->size?sb->size:128); size < sb->len+len+1; size *= 2);
+      if (!(data = realloc(sb->data, size))) return RETURN_FAIL;
+      sb->data = data; sb->size = size;
+   }
+   memcpy(sb->data+sb->len, str, len);
+   sb->len += len;
+   sb->data[sb->len] = 0;
+   return RETURN_OK;
+}
+
+#define POOL_NONE UINT_MAX
+
+static const char* pool_str(const strpool *sp, unsigned int id) {
+   return sp->arena.data + sp->offset[id];
+}
+
+/* id of string in pool, stored on first sight */
+static unsigned int pool_add(strpool *sp, const char *str) {
+   unsigned int *table, *offset, id, h, size;
+
+   if (sp->count*2 >= sp->tsize) {
+      size = (sp->tsize?sp->tsize*2:1024);
+      if (!(table = calloc(size, sizeof(unsigned int)))) return POOL_NONE;
+      for (id = 0; id != sp->count; ++id) {
+         for (h = _hash(pool_str(sp, id)) & (size-1); table[h]; h = (h+1) & (size-1));
+         table[h] = id+1;
+      }
+      if (sp->table) free(sp->table);
+      sp->table = table; sp->tsize = size;
+   }
+
+   for (h = _hash(str) & (sp->tsize-1); (id = sp->table[h]); h = (h+1) & (sp->tsize-1))
+      if (!strcmp(pool_str(sp, id-1), str)) return id-1;
+
+   if (sp->count == sp->size) {
+      size = (sp->size?sp->size*2:256);
+      if (!(offset = realloc(sp->offset, size * sizeof(unsigned int)))) return POOL_NONE;
+      sp->offset = offset; sp->size = size;
+   }
+   sp->offset[sp->count] = sp->arena.len;
+   if (sb_append(&sp->arena, str, strlen(str)+1) != RETURN_OK) return POOL_NONE;
+   sp->table[h] = sp->count+1;
+   return sp->count++;
+}
+
+static void free_pool(strpool *sp) {
+   if (sp->arena.data) free(sp->arena.data);
+   if (sp->offset) free(sp->offset);
+   if (sp->table) free(sp->table);
+   memset(sp, 0, sizeof(strpool));
+}
+
+/* decode utf8 codepoint, invalid bytes decode as themselves */
+static unsigned int _utf8dec(const unsigned char *s, size_t *len) {
+   unsigned int cp, n, i;
+   if (s[0] < 0x80) { *len = 1; return s[0]; }
+   else if ((s[0] & 0xE0) == 0xC0) { n = 2; cp = s[0] & 0x1F; }
+   else if ((s[0] & 0xF0) == 0xE0) { n = 3; cp = s[0] & 0x0F; }
+   else if ((s[0] & 0xF8) == 0xF0) { n = 4; cp = s[0] & 0x07; }
+   else { *len = 1; return s[0]; }
+   for (i = 1; i != n; ++i) {
+      if ((s[i] & 0xC0) != 0x80) { *len = 1; return s[0]; }
+      cp = (cp << 6) | (s[i] & 0x3F);
+   }
+   *len = n;
+   return cp;
+}
+
+/* encode utf8 codepoint */
+static size_t _utf8enc(unsigned int cp, char *out) {
+   if (cp < 0x80)    { out[0] = cp; return 1; }
+   if (cp < 0x800)   { out[0] = 0xC0|(cp>>6); out[1] = 0x80|(cp&0x3F); return 2; }
+   if (cp < 0x10000) { out[0] = 0xE0|(cp>>12); out[1] = 0x80|((cp>>6)&0x3F); out[2] = 0x80|(cp&0x3F); return 3; }
+   out[0] = 0xF0|(cp>>18); out[1] = 0x80|((cp>>12)&0x3F); out[2] = 0x80|((cp>>6)&0x3F); out[3] = 0x80|(cp&0x3F);
+   return 4;
+}
+
+/* width and case folding of single codepoint */
+static unsigned int _fold(unsigned int cp) {
+   if (cp == 0x3000) return ' ';
+   if (cp >= 0xFF01 && cp <= 0xFF5E) cp -= 0xFEE0;
+   if (cp >= 0xFF61 && cp <= 0xFF9F) cp = halfKana[cp-0xFF61];
+
+   if (cp < 0x80) return (cp >= 'A' && cp <= 'Z' ? cp+0x20 : cp);
+   if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) return cp+0x20;
+   if (cp >= 0x100 && cp <= 0x137) return cp|1;
+   if (cp >= 0x139 && cp <= 0x148) return (cp&1 ? cp+1 : cp);
+   if (cp >= 0x14A && cp <= 0x177) return cp|1;
+   if (cp == 0x178) return 0xFF;
+   if (cp >= 0x179 && cp <= 0x17E) return (cp&1 ? cp+1 : cp);
+   if (cp >= 0x391 && cp <= 0x3A9 && cp != 0x3A2) return cp+0x20;
+   if (cp >= 0x410 && cp <= 0x42F) return cp+0x20;
+   if (cp >= 0x400 && cp <= 0x40F) return cp+0x50;
+#if FOLD_KANA
+   if (cp >= 0x30A1 && cp <= 0x30F6) return cp-0x60;
+#endif
+   return cp;
+}
+
+/* compose kana with (han)dakuten mark, 0 if it does not compose
+ * unvoiced ka..chi are the odd code points, so ｶﾞｷﾞｸﾞ -> がぎぐ, ﾀﾞ -> だ,
+ * ﾊﾟ -> ぱ, while ガ with combining dakuten stays ガ+U+3099 */
+static unsigned int _voice(unsigned int cp, unsigned int mark) {
+   unsigned int k = (cp >= 0x3041 && cp <= 0x3096 ? cp+0x60 : cp), v = 0;
+   if (mark == 0x3099) {
+      if (k == 0x30A6) v = 0x30F4;
+      else if ((k >= 0x30AB && k <= 0x30C1 && (k&1)) || k == 0x30C4 ||
+               k == 0x30C6 || k == 0x30C8) v = k+1;
+   }
+   if (!v && (k == 0x30CF || k == 0x30D2 || k == 0x30D5 || k == 0x30D8 || k == 0x30DB))
+      v = k+(mark == 0x3099 ? 1 : 2);
+   if (!v) return 0;
+   return (k != cp ? v-0x60 : v);
+}
+
+/* normalize string for matching, case, width and optionally kana folded */
+static char* _normalize(const char *str, strbuf *sb) {
+   const unsigned char *s = (const unsigned char*)str;
+   unsigned int cp, prev = 0, next;
+   size_t len, plen = 0, nlen;
+   char enc[4];
+
+   sb->len = 0;
+   sb_append(sb, "", 0);
+   for (; *s; s += len) {
+      cp = _fold(_utf8dec(s, &len));
+
+      /* compose (halfwidth or combining) dakuten with previous kana */
+      if ((cp == 0x3099 || cp == 0x309A) && prev && (next = _voice(prev, cp))) {
+         sb->len -= plen;
+         cp = _fold(next);
+      }
+
+      nlen = _utf8enc(cp, enc);
+      if (cp < 0x80 || len != 1) sb_append(sb, enc, nlen);
+      else sb_append(sb, (const char*)s, 1); /* invalid byte, keep as is */
+      prev = cp; plen = (cp < 0x80 || len != 1 ? nlen : 1);
+   }
+   return sb->data;
+}
+
 /* uppercase strcmp */
 int _strupcmp(const char *hay, const char *needle)
 {
@@ -187,299 +577,2263 @@ static void _cprnt(FILE *out, char *buffer) {
       else if (buffer[i] == '\5') fprintf(out, "%s", colors[4]);
       else fprintf(out, "%c", buffer[i]);
    }
-   fprintf(out, "%s\n", colors[5]);
-   fflush(out);
-}
+   fprintf(out, "%s\n", colors[5]);
+   fflush(out);
+}
+
+/* printf wrapper */
+static void _prnt(FILE *out, const char *fmt, ...) {
+   va_list args;
+   char buffer[LINE_MAX];
+
+   memset(buffer, 0, LINE_MAX);
+   va_start(args, fmt);
+   vsnprintf(buffer, LINE_MAX-1, fmt, args);
+   va_end(args);
+   _cprnt(out, buffer);
+}
+
+/* monotonic time in microseconds */
+static unsigned long long _usec(const struct timespec *ts) {
+   return (unsigned long long)ts->tv_sec * 1000000ULL + ts->tv_nsec / 1000;
+}
+
+/* account time since last mark to phase */
+static void stats_phase(int phase) {
+   struct timespec now;
+   if (!stats.enabled) return;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if (phase >= 0 && phase < PHASE_LAST)
+      stats.phase[phase] += _usec(&now) - _usec(&stats.mark);
+   stats.mark = now;
+}
+
+/* dump counters as json to stderr */
+static void print_stats(void) {
+   int i;
+   unsigned long long total = 0, heap = 0;
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+   heap = mallinfo2().uordblks;
+#endif
+   stats_phase(-1);
+   fprintf(stderr, "{\"roundtrips\":%lu,\"song_bytes\":%llu,\"entities\":%lu,"
+         "\"match_song\":%lu,\"cover_scans\":%lu,\"cover_hits\":%lu,\"heap_bytes\":%llu,\"phases_us\":{",
+         stats.roundtrips, stats.songbytes, stats.entities, stats.matches,
+         stats.coverscans, stats.coverhits, heap);
+   for (i = 0; i != PHASE_LAST; ++i) {
+      fprintf(stderr, "\"%s\":%llu,", phaseNames[i], stats.phase[i]);
+      total += stats.phase[i];
+   }
+   fprintf(stderr, "\"total\":%llu}}\n", total);
+}
+
+/* approximate protocol bytes of song as decoded by libmpdclient,
+ * only summed with --stats as it walks every tag */
+static void stats_song(const struct mpd_song *song) {
+   const char *value;
+   unsigned long long n;
+   unsigned int t, i;
+   if (!song || !stats.enabled) return;
+   n = strlen("file: \n") + strlen(mpd_song_get_uri(song));
+   for (t = 0; t != MPD_TAG_COUNT; ++t)
+      for (i = 0; (value = mpd_song_get_tag(song, t, i)); ++i)
+         n += strlen(mpd_tag_name(t)) + strlen(": \n") + strlen(value);
+   __atomic_add_fetch(&stats.songbytes, n, __ATOMIC_RELAXED);
+}
+
+/* get mpd status */
+static struct mpd_status * get_status(void) {
+   struct mpd_status *status;
+   assert(mpd->connection);
+
+   if (!(status = mpd_recv_status(mpd->connection)))
+      goto mpd_error;
+   if (mpd->status) mpd_status_free(mpd->status);
+   return mpd->status = status;
+
+mpd_error:
+   MPDERR();
+   return NULL;
+}
+
+/* read exactly len bytes at offset */
+static int _pread(int fd, void *buf, size_t len, off_t off) {
+   ssize_t r;
+   size_t done = 0;
+   while (done != len) {
+      if ((r = pread(fd, (char*)buf+done, len-done, off+done)) <= 0) return RETURN_FAIL;
+      done += r;
+   }
+   return RETURN_OK;
+}
+
+static unsigned int _be32(const unsigned char *b) { return (b[0]<<24)|(b[1]<<16)|(b[2]<<8)|b[3]; }
+static unsigned int _le32(const unsigned char *b) { return (b[3]<<24)|(b[2]<<16)|(b[1]<<8)|b[0]; }
+static unsigned int _syncsafe(const unsigned char *b) { return (b[0]<<21)|(b[1]<<14)|(b[2]<<7)|b[3]; }
+
+/* fnv-1a 64bit, continued from hash */
+static unsigned long long _hash64(unsigned long long hash, const unsigned char *data, size_t len) {
+   for (; len; --len, ++data) hash = (hash ^ *data) * 1099511628211ULL;
+   return hash;
+}
+
+/* keep candidate if it is better than current, front cover wins */
+static void pick_cover(embedcover *best, embedcover *cand) {
+   if (!cand->len || cand->len > COVER_MAX || (best->len && (best->type == 3 || cand->type != 3))) {
+      if (cand->mem) free(cand->mem);
+   } else {
+      if (best->mem) free(best->mem);
+      *best = *cand;
+   }
+   memset(cand, 0, sizeof(embedcover));
+}
+
+/* flac METADATA_BLOCK_PICTURE, n bytes of len sized block available */
+static int parse_flac_picture(const unsigned char *b, size_t n, size_t len, embedcover *c) {
+   size_t off;
+   if (n < 8) return RETURN_FAIL;
+   c->type = _be32(b);
+   off = 8 + (size_t)_be32(b+4);                      /* type, mime */
+   if (off+4 > n) return RETURN_FAIL;
+   off += 4 + (size_t)_be32(b+off) + 16;              /* description, w, h, depth, colors */
+   if (off+4 > n) return RETURN_FAIL;
+   c->len = _be32(b+off);
+   c->off = off+4;
+   if (c->off > len || c->len > len-c->off) return RETURN_FAIL;
+   return RETURN_OK;
+}
+
+/* flac metadata blocks, never reads past the last one */
+static void scan_flac(int fd, off_t pos, off_t size, embedcover *best) {
+   unsigned char h[4], *b;
+   size_t len, n;
+   embedcover c;
+
+   for (; pos+4 <= size && _pread(fd, h, 4, pos) == RETURN_OK; pos += 4+len) {
+      len = (h[1]<<16)|(h[2]<<8)|h[3];
+      if ((h[0] & 0x7F) == 6 && (b = malloc((n = (len < TAG_READ_MAX ? len : TAG_READ_MAX))))) {
+         memset(&c, 0, sizeof(embedcover));
+         if (_pread(fd, b, n, pos+4) == RETURN_OK && parse_flac_picture(b, n, len, &c) == RETURN_OK) {
+            c.off += pos+4;
+            pick_cover(best, &c);
+         }
+         free(b);
+      }
+      if (h[0] & 0x80) break;
+   }
+}
+
+/* undo id3 unsynchronisation in place */
+static size_t _unsync(unsigned char *b, size_t len) {
+   size_t i, o;
+   for (i = o = 0; i != len; ++i) {
+      b[o++] = b[i];
+      if (b[i] == 0xFF && i+1 != len && b[i+1] == 0x00) ++i;
+   }
+   return o;
+}
+
+/* id3v2 APIC/PIC frame body, returns offset of image data */
+static size_t parse_apic(const unsigned char *b, size_t n, int v22, int *type) {
+   size_t i;
+   if (n < 4) return 0;
+   if (v22) i = 4;                                    /* encoding, image format */
+   else {
+      for (i = 1; i != n && b[i]; ++i);                /* encoding, mime */
+      ++i;
+   }
+   if (i >= n) return 0;
+   *type = b[i++];
+   if (b[0] == 1 || b[0] == 2) {                      /* utf-16 description */
+      for (; i+1 < n && (b[i] || b[i+1]); i += 2);
+      i += 2;
+   } else {
+      for (; i < n && b[i]; ++i);
+      i += 1;
+   }
+   return (i < n ? i : 0);
+}
+
+/* id3v2 tag at base, returns offset after the tag or base if there is none */
+static off_t scan_id3(int fd, off_t base, embedcover *best) {
+   unsigned char h[10], *b;
+   unsigned int ver, flags, fflags, len, hlen;
+   size_t n, doff;
+   off_t pos, end, body;
+   embedcover c;
+
+   if (_pread(fd, h, 10, base) != RETURN_OK || memcmp(h, "ID3", 3))
+      return base;
+
+   ver = h[3]; flags = h[5];
+   end = base + 10 + _syncsafe(h+6) + (flags & 0x10 ? 10 : 0);
+   if (ver < 2 || ver > 4 || (ver != 4 && (flags & 0x80))) /* whole tag unsynchronised */
+      return end;
+
+   pos = base + 10;
+   if ((flags & 0x40) && ver != 2 && _pread(fd, h, 4, pos) == RETURN_OK)
+      pos += (ver == 3 ? 4 + _be32(h) : _syncsafe(h));
+
+   hlen = (ver == 2 ? 6 : 10);
+   for (; pos+hlen <= end && _pread(fd, h, hlen, pos) == RETURN_OK && h[0]; pos += hlen+len) {
+      if (ver == 2) len = (h[3]<<16)|(h[4]<<8)|h[5];
+      else len = (ver == 4 ? _syncsafe(h+4) : _be32(h+4));
+      if (!len || pos+hlen+len > end) break;
+      if (ver == 2 ? memcmp(h, "PIC", 3) : memcmp(h, "APIC", 4)) continue;
+
+      body = pos+hlen; n = len;
+      fflags = (ver == 2 ? 0 : h[9]);
+      if (ver == 3 && (fflags & 0xC0)) continue;      /* compressed, encrypted */
+      if (ver == 4 && (fflags & 0x0C)) continue;
+      if ((ver == 3 && (fflags & 0x20)) || (ver == 4 && (fflags & 0x40))) { ++body; --n; }
+      if (ver == 4 && (fflags & 0x01)) { body += 4; n -= 4; }
+      if ((ssize_t)n <= 0) continue;
+
+      memset(&c, 0, sizeof(embedcover));
+      if (ver == 4 && (fflags & 0x02)) {
+         /* unsynchronised frame has to be read whole */
+         if (n > COVER_MAX || !(b = malloc(n))) continue;
+         if (_pread(fd, b, n, body) == RETURN_OK && (n = _unsync(b, n)) &&
+             (doff = parse_apic(b, n, 0, &c.type))) {
+            memmove(b, b+doff, n-doff);
+            c.mem = b; c.len = n-doff;
+            pick_cover(best, &c);
+         } else free(b);
+      } else if ((b = malloc(n < TAG_READ_MAX ? n : TAG_READ_MAX))) {
+         if (_pread(fd, b, (n < TAG_READ_MAX ? n : TAG_READ_MAX), body) == RETURN_OK &&
+             (doff = parse_apic(b, (n < TAG_READ_MAX ? n : TAG_READ_MAX), ver == 2, &c.type))) {
+            c.off = body+doff; c.len = n-doff;
+            pick_cover(best, &c);
+         }
+         free(b);
+      }
+   }
+   return end;
+}
+
+/* find child atom of type inside [start, end) */
+static int find_atom(int fd, off_t start, off_t end, const char *type, off_t *body, off_t *bend) {
+   unsigned char h[16];
+   unsigned long long size;
+   unsigned int hlen;
+   off_t pos;
+
+   for (pos = start; pos+8 <= end; pos += size) {
+      if (_pread(fd, h, 8, pos) != RETURN_OK) return RETURN_FAIL;
+      size = _be32(h); hlen = 8;
+      if (size == 1) {
+         if (_pread(fd, h+8, 8, pos+8) != RETURN_OK) return RETURN_FAIL;
+         size = ((unsigned long long)_be32(h+8) << 32) | _be32(h+12); hlen = 16;
+      } else if (size == 0) size = end-pos;
+      if (size < hlen || pos+(off_t)size > end) return RETURN_FAIL;
+      if (memcmp(h+4, type, 4)) continue;
+      *body = pos+hlen; *bend = pos+size;
+      return RETURN_OK;
+   }
+   return RETURN_FAIL;
+}
+
+/* mp4 moov/udta/meta/ilst/covr/data, mdat is skipped by its size */
+static void scan_mp4(int fd, off_t size, embedcover *best) {
+   static const char *path[] = { "moov", "udta", "meta", "ilst", "covr", "data", NULL };
+   unsigned char h[8];
+   off_t body = 0, end = size;
+   embedcover c;
+   int i;
+
+   for (i = 0; path[i]; ++i) {
+      if (find_atom(fd, body, end, path[i], &body, &end) != RETURN_OK) return;
+      /* meta is full box, except in quicktime files */
+      if (!strcmp(path[i], "meta") && _pread(fd, h, 8, body) == RETURN_OK && memcmp(h+4, "hdlr", 4))
+         body += 4;
+   }
+
+   /* data: type indicator, locale, image */
+   if (end-body <= 8) return;
+   memset(&c, 0, sizeof(embedcover));
+   c.off = body+8; c.len = end-body-8; c.type = 3;
+   pick_cover(best, &c);
+}
+
+/* riff chunks, wav can carry id3 tag in "id3 " chunk */
+static void scan_riff(int fd, off_t size, embedcover *best) {
+   unsigned char h[8];
+   off_t pos;
+   for (pos = 12; pos+8 <= size && _pread(fd, h, 8, pos) == RETURN_OK; pos += 8 + ((_le32(h+4)+1) & ~1U)) {
+      if (!memcmp(h, "id3 ", 4) || !memcmp(h, "ID3 ", 4))
+         scan_id3(fd, pos+8, best);
+   }
+}
+
+/* decode base64 in place, returns decoded length */
+static size_t _base64(unsigned char *b, size_t len) {
+   size_t i, o = 0;
+   unsigned int acc = 0, bits = 0, v;
+   for (i = 0; i != len; ++i) {
+      if (b[i] >= 'A' && b[i] <= 'Z') v = b[i]-'A';
+      else if (b[i] >= 'a' && b[i] <= 'z') v = b[i]-'a'+26;
+      else if (b[i] >= '0' && b[i] <= '9') v = b[i]-'0'+52;
+      else if (b[i] == '+') v = 62;
+      else if (b[i] == '/') v = 63;
+      else continue;
+      acc = (acc << 6) | v; bits += 6;
+      if (bits >= 8) { bits -= 8; b[o++] = (acc >> bits) & 0xFF; }
+   }
+   return o;
+}
+
+/* picture from vorbis comment, METADATA_BLOCK_PICTURE or old COVERART */
+static void parse_picture_comment(unsigned char *b, size_t len, embedcover *best) {
+   embedcover c;
+   size_t n;
+   memset(&c, 0, sizeof(embedcover));
+   if (len > 23 && !strncasecmp((char*)b, "METADATA_BLOCK_PICTURE=", 23)) {
+      n = _base64(b+23, len-23);
+      if (parse_flac_picture(b+23, n, n, &c) != RETURN_OK) return;
+      if (!(c.mem = malloc(c.len))) return;
+      memcpy(c.mem, b+23+c.off, c.len);
+   } else if (len > 9 && !strncasecmp((char*)b, "COVERART=", 9)) {
+      if (!(c.len = _base64(b+9, len-9)) || !(c.mem = malloc(c.len))) return;
+      memcpy(c.mem, b+9, c.len);
+   } else return;
+   c.off = 0;
+   pick_cover(best, &c);
+}
+
+/* ogg vorbis/opus comment header, the second packet of the stream */
+static void scan_ogg(int fd, off_t size, embedcover *best) {
+   unsigned char h[27+255], *page, *pkt = NULL, *tmp, *p, *end;
+   size_t plen = 0, body, i, seg, count, len;
+   int packet = 0;
+   off_t pos;
+
+   if (!(page = malloc(255*255)))
+      return;
+
+   for (pos = 0; packet < 2 && pos+27 <= size; pos += 27+h[26]+body) {
+      if (_pread(fd, h, 27, pos) != RETURN_OK || memcmp(h, "OggS", 4) ||
+          _pread(fd, h+27, h[26], pos+27) != RETURN_OK)
+         break;
+      for (body = 0, i = 0; i != h[26]; ++i) body += h[27+i];
+      if (_pread(fd, page, body, pos+27+h[26]) != RETURN_OK)
+         break;
+
+      for (seg = 0, i = 0; i != h[26] && packet < 2; seg += h[27+i], ++i) {
+         if (packet == 1) {
+            if (plen + h[27+i] > COVER_MAX*2 || !(tmp = realloc(pkt, plen + h[27+i] + 1))) { packet = 3; break; }
+            pkt = tmp;
+            memcpy(pkt+plen, page+seg, h[27+i]);
+            plen += h[27+i];
+         }
+         if (h[27+i] < 255) ++packet;
+      }
+   }
+   free(page);
+
+   if (packet == 2 && pkt) {
+      p = pkt; end = pkt+plen;
+      if (plen > 7 && !memcmp(p, "\3vorbis", 7)) p += 7;
+      else if (plen > 8 && !memcmp(p, "OpusTags", 8)) p += 8;
+      else p = end;
+      if (p+4 <= end && (len = _le32(p)) <= (size_t)(end-p-4)) p += 4+len; /* vendor */
+      else p = end;
+      for (count = (p+4 <= end ? _le32(p) : 0), p += 4; count && p+4 <= end; --count) {
+         len = _le32(p); p += 4;
+         if (len > (size_t)(end-p)) break;
+         parse_picture_comment(p, len, best);
+         p += len;
+      }
+   }
+   if (pkt) free(pkt);
+}
+
+/* copy picture to <base>.jpg/png in cover cache, replacing earlier one */
+static char* store_cover(int fd, const embedcover *c, const char *base) {
+   char tmp[PATH_MAX], path[PATH_MAX];
+   unsigned char buf[65536];
+   const char *ext = "jpg";
+   size_t done, n;
+   int out;
+
+   snprintf(tmp, sizeof(tmp), "%s/.cover-XXXXXX", COVER_CACHE);
+   if ((out = mkstemp(tmp)) == -1)
+      return NULL;
+
+   for (done = 0; done != c->len; done += n) {
+      n = (c->len-done < sizeof(buf) ? c->len-done : sizeof(buf));
+      if (c->mem) memcpy(buf, c->mem+done, n);
+      else if (_pread(fd, buf, n, c->off+done) != RETURN_OK) goto fail;
+      if (!done && n >= 4 && !memcmp(buf, "\x89PNG", 4)) ext = "png";
+      if (write(out, buf, n) != (ssize_t)n) goto fail;
+   }
+   close(out);
+
+   if (snprintf(path, sizeof(path), "%s.%s", base, ext) >= (int)sizeof(path) ||
+       rename(tmp, path) != 0) {
+      unlink(tmp);
+      return NULL;
+   }
+   return strdup(path);
+
+fail:
+   close(out);
+   unlink(tmp);
+   return NULL;
+}
+
+/* extract embedded cover from audio file, file type is detected from content */
+static char* extract_cover(const char *file, const char *base) {
+   unsigned char magic[12];
+   char *cover = NULL;
+   struct stat st;
+   embedcover best;
+   off_t off;
+   int fd;
+
+   if ((fd = open(file, O_RDONLY)) == -1)
+      return NULL;
+
+   memset(&best, 0, sizeof(embedcover));
+   if (fstat(fd, &st) == 0) {
+      off = scan_id3(fd, 0, &best);
+      if (_pread(fd, magic, sizeof(magic), off) == RETURN_OK) {
+         if (!memcmp(magic, "fLaC", 4)) scan_flac(fd, off+4, st.st_size, &best);
+         else if (!memcmp(magic, "OggS", 4)) scan_ogg(fd, st.st_size, &best);
+         else if (!memcmp(magic, "RIFF", 4) && !memcmp(magic+8, "WAVE", 4)) scan_riff(fd, st.st_size, &best);
+         else if (!memcmp(magic+4, "ftyp", 4)) scan_mp4(fd, st.st_size, &best);
+      }
+      if (best.len) cover = store_cover(fd, &best, base);
+   }
+
+   if (best.mem) free(best.mem);
+   close(fd);
+   return cover;
+}
+
+static pthread_once_t coverCacheOnce = PTHREAD_ONCE_INIT;
+static int coverCacheOk;
+
+/* cover cache is only used when it is our private directory */
+static void check_cover_cache(void) {
+   struct stat st;
+   mkdir(COVER_CACHE, 0700);
+   coverCacheOk = (lstat(COVER_CACHE, &st) == 0 && S_ISDIR(st.st_mode) &&
+         st.st_uid == getuid() && !(st.st_mode & 077));
+   if (!coverCacheOk) ERR("Not using cover cache, not a private directory: %s", COVER_CACHE);
+}
+
+/* remembered cover of directory, one link per directory to "<dir mtime>/"
+ * and sidecar cover, "none" or "<mtime>/<audio file>/<cover|none>" when it
+ * came from the audio file. old gets the extracted image of a stale link */
+static int cached_cover(const char *link, const char *rdir, unsigned long dmtime, char **cover, char *old, size_t size) {
+   char target[PATH_MAX], file[PATH_MAX], *name, *rest, *path;
+   struct stat st;
+   ssize_t len;
+   int fresh;
+
+   *old = 0;
+   if ((len = readlink(link, target, sizeof(target)-1)) <= 0) return RETURN_FAIL;
+   target[len] = 0;
+   if (!(rest = strchr(target, '/'))) goto stale;
+   *rest++ = 0;
+   fresh = (strtoul(target, NULL, 16) == dmtime);
+
+   path = rest;
+   if (*rest != '/' && strcmp(rest, "none")) {
+      /* embedded art changes with the audio file, not the directory */
+      if (!(name = strchr(rest, '/')) || !(path = strchr(name+1, '/'))) goto stale;
+      *name++ = 0; *path++ = 0;
+      if (!strncmp(path, COVER_CACHE"/", strlen(COVER_CACHE)+1))
+         snprintf(old, size, "%s", path);
+      if (snprintf(file, sizeof(file), "%s/%s", rdir, name) >= (int)sizeof(file) ||
+          stat(file, &st) != 0 || strtoul(rest, NULL, 16) != (unsigned long)st.st_mtime)
+         fresh = 0;
+   }
+
+   /* cover may be gone since it was remembered */
+   if (!fresh || (strcmp(path, "none") && access(path, R_OK) != 0))
+      goto stale;
+   *old = 0;
+   *cover = (strcmp(path, "none") ? strdup(path) : NULL);
+   return RETURN_OK;
+
+stale:
+   unlink(link);
+   return RETURN_FAIL;
+}
+
+/* point link of directory to target, replaced at once so readers never miss it */
+static void remember_cover(const char *link, const char *target) {
+   char tmp[PATH_MAX];
+   if (snprintf(tmp, sizeof(tmp), "%s.%d.%lx", link, (int)getpid(),
+          (unsigned long)pthread_self()) >= (int)sizeof(tmp))
+      return;
+   if (symlink(target, tmp) != 0 || rename(tmp, link) != 0) {
+      unlink(tmp);
+      OUT("Could not remember cover: %s", link);
+   }
+}
+
+/* fetch cover art, remembered per directory in cover cache */
+static char* fetch_cover(const char *dir) {
+   struct dirent **names; int n, i;
+   char rdir[PATH_MAX], link[PATH_MAX], target[PATH_MAX], file[PATH_MAX], old[PATH_MAX];
+   char fcover[256], faudio[256], *cover = NULL;
+   unsigned long long hash;
+   unsigned long dmtime;
+   const char *ext;
+   struct stat st;
+   int f;
+
+   memset(fcover, 0, sizeof(fcover));
+   memset(faudio, 0, sizeof(faudio));
+   if (snprintf(rdir, sizeof(rdir), "%s/%s", MUSIC_DIR, dir) >= (int)sizeof(rdir) ||
+       stat(rdir, &st) != 0)
+      return NULL;
+
+   /* directory changes when covers are added or removed */
+   pthread_once(&coverCacheOnce, check_cover_cache);
+   dmtime = (unsigned long)st.st_mtime;
+   hash = _hash64(14695981039346656037ULL, (const unsigned char*)rdir, strlen(rdir));
+   snprintf(link, sizeof(link), "%s/d%016llx", COVER_CACHE, hash);
+   old[0] = 0;
+   if (coverCacheOk && cached_cover(link, rdir, dmtime, &cover, old, sizeof(old)) == RETURN_OK) {
+      STAT(coverhits);
+      return cover;
+   }
+
+   STAT(coverscans);
+   if ((n = scandir(rdir, &names, 0, alphasort)) == -1)
+      return NULL;
+   for (i = 0; i != n; ++i) {
+      if (names[i]->d_type != DT_REG) continue;
+      if (_strupstr(names[i]->d_name, ".jpg") || _strupstr(names[i]->d_name, ".png")) {
+         snprintf(fcover, sizeof(fcover), "%s", names[i]->d_name);
+         break;
+      }
+      for (f = 0; !faudio[0] && (ext = fileFormats[f]); ++f) {
+         if (strlen(names[i]->d_name) < strlen(ext)) continue;
+         if (!_strupcmp(names[i]->d_name+strlen(names[i]->d_name)-strlen(ext), ext))
+            snprintf(faudio, sizeof(faudio), "%s", names[i]->d_name);
+      }
+   }
+   for (i = 0; i != n; ++i) free(names[i]);
+   free(names);
+
+   if (fcover[0]) {
+      if (snprintf(file, sizeof(file), "%s/%s", rdir, fcover) < (int)sizeof(file))
+         cover = strdup(file);
+      snprintf(target, sizeof(target), "%lx/%s", dmtime, (cover?cover:"none"));
+   } else if (faudio[0] && coverCacheOk &&
+         snprintf(file, sizeof(file), "%s/%s", rdir, faudio) < (int)sizeof(file)) {
+      /* extracted image is named after the directory, one per directory */
+      snprintf(target, sizeof(target), "%s/c%016llx", COVER_CACHE, hash);
+      cover = extract_cover(file, target);
+      if (stat(file, &st) != 0 ||
+          snprintf(target, sizeof(target), "%lx/%lx/%s/%s", dmtime, (unsigned long)st.st_mtime,
+             faudio, (cover?cover:"none")) >= (int)sizeof(target))
+         return cover;
+   } else {
+      snprintf(target, sizeof(target), "%lx/none", dmtime);
+   }
+
+   if (coverCacheOk) {
+      remember_cover(link, target);
+      /* image extracted before is superseded */
+      if (old[0] && (!cover || strcmp(old, cover))) unlink(old);
+   }
+   return cover;
+}
+
+/* get cover art for song */
+static char* get_cover_art(const struct mpd_song *song) {
+   char *uric, *ret; const char *uri, *urid;
+   if (!song || !(uri = mpd_song_get_uri(song)) || !((uric = strdup(uri))))
+      return NULL;
+   urid = dirname(uric);
+   stats_phase(PHASE_COMMAND);
+   ret = fetch_cover(urid);
+   stats_phase(PHASE_COVER);
+   free(uric);
+   return ret;
+}
+
+/* get tag value of song, artist/album/title have fallbacks.
+ * scratch (PATH_MAX) holds the uri copy for dirname/basename */
+static const char* song_tag(const struct mpd_song *song, char type, enum mpd_tag_type tag, char *scratch) {
+   const char *ret = NULL;
+   switch (type) {
+      case FMT_ARTIST:
+         if (!(ret = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0)) &&
+             !(ret = mpd_song_get_tag(song, MPD_TAG_ALBUM_ARTIST, 0)) &&
+             !(ret = mpd_song_get_tag(song, MPD_TAG_COMPOSER, 0)) &&
+             !(ret = mpd_song_get_tag(song, MPD_TAG_PERFORMER, 0)))
+            ret = "noartist";
+         break;
+      case FMT_ALBUM:
+         if (!(ret = mpd_song_get_tag(song, MPD_TAG_ALBUM, 0))) {
+            snprintf(scratch, PATH_MAX, "%s", mpd_song_get_uri(song));
+            ret = basename(dirname(scratch));
+         }
+         if (!ret) ret = "noalbum";
+         break;
+      case FMT_TITLE:
+         if (!(ret = mpd_song_get_tag(song, MPD_TAG_TITLE, 0)) &&
+             !(ret = mpd_song_get_tag(song, MPD_TAG_NAME, 0))) {
+            snprintf(scratch, PATH_MAX, "%s", mpd_song_get_uri(song));
+            ret = basename(scratch);
+         }
+         if (!ret) ret = "notitle";
+         break;
+      case FMT_FILE:
+         ret = mpd_song_get_uri(song);
+         break;
+      case FMT_TAG:
+         ret = mpd_song_get_tag(song, tag, 0);
+         break;
+   }
+   return ret;
+}
+
+/* disc/track number of tag like "3/12" */
+static unsigned int tag_number(const char *str) {
+   return (str && *str >= '0' && *str <= '9' ? strtoul(str, NULL, 10) : UINT_MAX);
+}
+
+/* compile format template into op list */
+static fmtop* parse_format(const char *str) {
+   const char *p, *end;
+   size_t n, len;
+   fmtop *fmt, *op;
+   int t;
+
+   /* every op consumes at least one character */
+   if (!(op = fmt = calloc(strlen(str)+1, sizeof(fmtop)))) {
+      MEMERR(fmtop);
+      return NULL;
+   }
+
+   for (p = str; *p; ++op) {
+      if (*p == '%' && (end = strchr(p+1, '%'))) {
+         len = end-(p+1);
+         for (t = 0; len && formatTags[t].name; ++t) {
+            if (strlen(formatTags[t].name) != len) continue;
+            if (!strncmp(formatTags[t].name, p+1, len)) break;
+         }
+         if (len && formatTags[t].name) {
+            op->type = formatTags[t].type;
+            op->tag  = formatTags[t].tag;
+            p = end+1;
+            continue;
+         }
+         if (!len) { /* %% */
+            op->type = FMT_LITERAL;
+            op->str = p; op->len = 1;
+            p = end+1;
+            continue;
+         }
+         ERR("Unknown format tag: %%%.*s%%", (int)len, p+1);
+         free(fmt);
+         return NULL;
+      }
+      n = strcspn(p+1, "%")+1;
+      op->type = FMT_LITERAL;
+      op->str = p; op->len = n;
+      p += n;
+   }
+   op->type = FMT_END;
+   return fmt;
+}
+
+/* default format, written out so the common path interprets nothing */
+static void render_default(const struct mpd_song *song, strbuf *sb, char *scratch) {
+   const char *str;
+   str = song_tag(song, FMT_ARTIST, MPD_TAG_ARTIST, scratch);
+   sb_append(sb, str, strlen(str));
+   sb_append(sb, SEPERATOR, sizeof(SEPERATOR)-1);
+   str = song_tag(song, FMT_ALBUM, MPD_TAG_ALBUM, scratch);
+   sb_append(sb, str, strlen(str));
+   sb_append(sb, SEPERATOR, sizeof(SEPERATOR)-1);
+   str = song_tag(song, FMT_TITLE, MPD_TAG_TITLE, scratch);
+   sb_append(sb, str, strlen(str));
+}
+
+/* song as single line, points to buffer reused by next call */
+/* append format ops from op up to end (or FMT_END) */
+static void render_ops(const struct mpd_song *song, const fmtop *op, const fmtop *end, strbuf *sb, char *scratch) {
+   const char *str;
+   for (; op != end && op->type != FMT_END; ++op) {
+      if (op->type == FMT_LITERAL) sb_append(sb, op->str, op->len);
+      else if ((str = song_tag(song, op->type, op->tag, scratch)))
+         sb_append(sb, str, strlen(str));
+   }
+}
+
+static char* song_line(const struct mpd_song *song) {
+   static strbuf sb;
+   char scratch[PATH_MAX];
+   if (!song) return NULL;
+
+   sb.len = 0;
+   sb_append(&sb, "", 0);
+   if (!format) render_default(song, &sb, scratch);
+   else render_ops(song, format, NULL, &sb, scratch);
+   return sb.data;
+}
+
+/* print song line, with cover art if any */
+static void print_line(const char *line, const char *cover) {
+   if (cover) printf("IMG:%s\t", cover);
+   fwrite(line, 1, strlen(line), stdout);
+   putchar('\n');
+}
+
+/* add song to queue */
+static int print_song(const struct mpd_song *song, const char *cover) {
+   char *line;
+   if (!song || !(line = song_line(song))) return RETURN_FAIL;
+   print_line(line, cover);
+   return RETURN_OK;
+}
+
+/* normalize needle and split it to tokens */
+static int init_query(mpdquery *q, const char *needle) {
+   strbuf sb = { NULL, 0, 0 };
+   char *tok, **tokens;
+   memset(q, 0, sizeof(mpdquery));
+   q->needle = needle;
+   if (!(q->key = _normalize(needle, &sb)) || !(q->tokbuf = strdup(q->key)))
+      return RETURN_FAIL;
+
+   /* missing tokens would match more than asked for */
+   for (tok = strtok(q->tokbuf, " "); tok; tok = strtok(NULL, " ")) {
+      if (!(tokens = realloc(q->tokens, (q->tokc+1) * sizeof(char*)))) return RETURN_FAIL;
+      q->tokens = tokens;
+      q->tokens[q->tokc++] = tok;
+   }
+   return RETURN_OK;
+}
+
+/* free query */
+static void free_query(mpdquery *q) {
+   if (q->tokbuf) free(q->tokbuf);
+   if (q->tokens) free(q->tokens);
+   if (q->key) free(q->key);
+   memset(q, 0, sizeof(mpdquery));
+}
+
+/* normalized match key of line, points to buffer reused by next call */
+static char* line_key(const char *line) {
+   static strbuf sb;
+   return _normalize(line, &sb);
+}
+
+/* match single line and its key against query, plain byte matching */
+static int match_line(const mpdquery *q, const char *whole, const char *key, int *exact) {
+   int i;
+   if (exact) *exact = 0;
+   STAT(matches);
+
+   if (!strcmp(q->needle, whole)) {
+      if (exact) *exact = 1;
+      return RETURN_OK;
+   }
+   if (strstr(key, q->key))
+      return RETURN_OK;
+
+   /* every token must be found */
+   for (i = 0; i != q->tokc && strstr(key, q->tokens[i]); ++i);
+   return (q->tokc && i == q->tokc ? RETURN_OK : RETURN_FAIL);
+}
+
+/* now playing */
+static void now_playing(int printimg) {
+   char *cover;
+   struct mpd_song *song = MPDRT(mpd_run_current_song(mpd->connection));
+   if (!song) return;
+   print_song(song, NULL);
+   if (printimg && (cover = get_cover_art(song))) {
+      printf("%s\n", cover);
+      free(cover);
+   }
+   mpd_song_free(song);
+}
+
+/* stream queue in ranges, func returns RETURN_STOP to stop early or
+ * RETURN_FAIL on error, which is passed on */
+static int foreach_queue(mpdsongfunc func, void *data) {
+   unsigned int pos, end, last;
+   int stop = 0, ret = RETURN_OK;
+   const struct mpd_song *song;
+   struct mpd_entity *entity;
+   assert(mpd && mpd->connection);
+
+   for (pos = 0, end = MPD_OUTPUT_BUFFER; !stop && pos < mpd->state.queuelen &&
+         MPDRT(mpd_send_list_queue_range_meta(mpd->connection, pos, end));
+         pos = end, end *= 2) {
+      last = pos;
+      while (!stop && (entity = mpd_recv_entity(mpd->connection))) {
+         STAT(entities);
+         if (mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
+            song = mpd_entity_get_song(entity);
+            stats_song(song);
+            last = mpd_song_get_pos(song)+1;
+            stop = ((ret = func(song, data)) != RETURN_OK);
+         }
+         mpd_entity_free(entity);
+      }
+      if (last < end) break;
+   }
+
+   if (!mpd_response_finish(mpd->connection)) {
+      MPDERR();
+      return RETURN_FAIL;
+   }
+
+   mpd->queue.version = mpd_status_get_queue_version(mpd->status);
+   return (ret == RETURN_FAIL ? RETURN_FAIL : RETURN_OK);
+}
+
+/* open cache for reading, only when it is ours and nobody else can write it */
+static FILE* open_cache(const char *path) {
+   FILE *f;
+   struct stat st;
+   if (!(f = fopen(path, "r"))) return NULL;
+   if (fstat(fileno(f), &st) != 0 || st.st_uid != getuid() || (st.st_mode & 022)) {
+      fclose(f);
+      return NULL;
+   }
+   return f;
+}
+
+/* private temporary file, renamed over cache by commit_cache */
+static FILE* create_cache(const char *path, char *tmp, size_t size) {
+   FILE *f;
+   int fd;
+   snprintf(tmp, size, "%s.XXXXXX", path);
+   if ((fd = mkstemp(tmp)) < 0) return NULL;
+   if (!(f = fdopen(fd, "w"))) {
+      close(fd);
+      unlink(tmp);
+      return NULL;
+   }
+   return f;
+}
+
+static int commit_cache(FILE *f, const char *tmp, const char *path) {
+   if (fclose(f) != 0 || rename(tmp, path) != 0) {
+      unlink(tmp);
+      return RETURN_FAIL;
+   }
+   return RETURN_OK;
+}
+
+/* header of queue cache, ties it to server, queue version and format */
+static void queue_header(char *header, size_t size) {
+   snprintf(header, size, QUEUE_MAGIC" %s:%u %u %u %lx %d\n", mpd->host, mpd->port,
+         mpd->state.queuever, mpd->state.queuelen, formatHash, FOLD_KANA);
+}
+
+/* queue cache of current queue version opened at first record.
+ * a restarted mpd or another server may reach the same version and length
+ * with other song ids, so the current song must be found at its position */
+static FILE* open_queue_cache(void) {
+   FILE *f;
+   char header[PATH_MAX], expect[PATH_MAX], *line = NULL, *tab;
+   size_t size = 0;
+   long start;
+   int pos, ok = 0;
+
+   if (mpd->state.songpos < 0 || !(f = open_cache(QUEUE_CACHE))) return NULL;
+   queue_header(expect, sizeof(expect));
+   if (!fgets(header, sizeof(header), f) || strcmp(header, expect) ||
+       (start = ftell(f)) < 0)
+      goto fail;
+
+   for (pos = 0; pos <= mpd->state.songpos && getline(&line, &size, f) > 0; ++pos);
+   if (pos > mpd->state.songpos && strtoul(line, &tab, 10) == (unsigned int)mpd->state.song &&
+       *tab == '\t' && !fseek(f, start, SEEK_SET))
+      ok = 1;
+
+fail:
+   if (line) free(line);
+   if (!ok) {
+      fclose(f);
+      return NULL;
+   }
+   return f;
+}
+
+static int read_queue_cache(FILE *f, mpdentryfunc func, void *data) {
+   char *line = NULL, *tab;
+   size_t size = 0;
+   ssize_t len;
+   queueentry e;
+   int ret = RETURN_OK, broken = 0;
+
+   for (e.pos = 0; ret == RETURN_OK && (len = getline(&line, &size, f)) > 0; ++e.pos) {
+      if (line[len-1] == '\n') line[len-1] = 0;
+      e.id = strtoul(line, &tab, 10);
+      if (*tab != '\t' || !(e.key = strchr(tab+1, '\t'))) {
+         broken = 1;
+         break;
+      }
+      e.line = tab+1; *e.key++ = 0;
+      ret = func(&e, data);
+   }
+
+   /* walked whole, record count must match queue */
+   if (ret == RETURN_OK && (broken || e.pos != mpd->state.queuelen)) {
+      ERR("Queue cache is broken: %s", QUEUE_CACHE);
+      ret = RETURN_FAIL;
+   }
+   if (line) free(line);
+   fclose(f);
+   return (ret == RETURN_FAIL ? RETURN_FAIL : RETURN_OK);
+}
+
+typedef struct walkdata {
+   mpdsongfunc songfunc;
+   mpdentryfunc entryfunc;
+   void *data;
+   FILE *cache;
+   int stop, broken;
+} walkdata;
+
+/* pass song on, then its entry with match key, which goes to queue cache too */
+static int walk_song(const struct mpd_song *song, void *data) {
+   walkdata *wd = data;
+   queueentry e;
+   char *c;
+   int ret;
+
+   if (wd->songfunc && (ret = wd->songfunc(song, wd->data)) != RETURN_OK)
+      goto stop;
+   if (!wd->cache && !wd->entryfunc)
+      return RETURN_OK;
+
+   if (!(e.line = song_line(song))) {
+      wd->broken = 1;
+      return RETURN_OK;
+   }
+   for (c = e.line; (c = strpbrk(c, "\t\n")); ) *c = ' ';
+   e.key = line_key(e.line);
+   e.id  = mpd_song_get_id(song);
+   e.pos = mpd_song_get_pos(song);
+   if (wd->cache) fprintf(wd->cache, "%u\t%s\t%s\n", e.id, e.line, e.key);
+   if (wd->entryfunc && (ret = wd->entryfunc(&e, wd->data)) != RETURN_OK)
+      goto stop;
+   return RETURN_OK;
+
+stop:
+   wd->stop = 1;
+   return ret;
+}
+
+/* walk queue from mpd and keep match keys in queue cache when walked whole,
+ * entries alone may come from the cache while the queue has not changed */
+static int walk_queue(mpdsongfunc songfunc, mpdentryfunc entryfunc, void *data, int cached) {
+   FILE *f;
+   walkdata wd;
+   char tmp[PATH_MAX], header[PATH_MAX];
+   int ret;
+
+   stats_phase(PHASE_COMMAND);
+   if (cached && !songfunc && (f = open_queue_cache())) {
+      ret = read_queue_cache(f, entryfunc, data);
+      stats_phase(PHASE_RECEIVE);
+      return ret;
+   }
+
+   memset(&wd, 0, sizeof(walkdata));
+   wd.songfunc = songfunc; wd.entryfunc = entryfunc; wd.data = data;
+   if ((wd.cache = create_cache(QUEUE_CACHE, tmp, sizeof(tmp)))) {
+      queue_header(header, sizeof(header));
+      fputs(header, wd.cache);
+   }
+
+   ret = foreach_queue(walk_song, &wd);
+   if (wd.cache) {
+      if (ret == RETURN_OK && !wd.stop && !wd.broken) commit_cache(wd.cache, tmp, QUEUE_CACHE);
+      else {
+         fclose(wd.cache);
+         unlink(tmp);
+      }
+   }
+   stats_phase(PHASE_RECEIVE);
+   return ret;
+}
+
+static int list_song(const struct mpd_song *song, void *data) {
+   print_song(song, NULL);
+   return RETURN_OK;
+}
+
+/* cover lookup worker */
+static void* cover_worker(void *data) {
+   coverpool *cp = data;
+   coverslot *slot;
+   char *cover;
+
+   pthread_mutex_lock(&cp->lock);
+   while (1) {
+      while (!cp->quit && cp->next == cp->tail)
+         pthread_cond_wait(&cp->work, &cp->lock);
+      if (cp->next == cp->tail) break;
+
+      slot = &cp->slot[cp->next++ % COVER_WINDOW];
+      if (slot->state != SLOT_PENDING) continue;
+      slot->state = SLOT_RUNNING;
+      pthread_mutex_unlock(&cp->lock);
+      cover = fetch_cover(slot->dir);
+      pthread_mutex_lock(&cp->lock);
+      slot->cover = cover;
+      slot->state = SLOT_DONE;
+      pthread_cond_broadcast(&cp->done);
+   }
+   pthread_mutex_unlock(&cp->lock);
+   return NULL;
+}
+
+/* print oldest song of window once its cover is known */
+static void flush_cover(coverpool *cp) {
+   coverslot *slot = &cp->slot[cp->head % COVER_WINDOW], done;
+
+   pthread_mutex_lock(&cp->lock);
+   if (!cp->threads && slot->state == SLOT_PENDING) {
+      slot->cover = fetch_cover(slot->dir);
+      slot->state = SLOT_DONE;
+   }
+   while (slot->state == SLOT_PENDING || slot->state == SLOT_RUNNING)
+      pthread_cond_wait(&cp->done, &cp->lock);
+
+   /* recycle slot under lock, workers skip what is already printed */
+   done = *slot;
+   memset(slot, 0, sizeof(coverslot));
+   if (cp->next <= cp->head) cp->next = cp->head+1;
+   cp->head++;
+   pthread_mutex_unlock(&cp->lock);
+
+   /* same directory as previous song, reuse its cover */
+   if (done.state == SLOT_SAME) {
+      STAT(coverhits);
+   } else {
+      if (cp->lcover) free(cp->lcover);
+      cp->lcover = done.cover;
+   }
+
+   print_line(done.line, cp->lcover);
+   free(done.line);
+   free(done.dir);
+}
+
+/* queue song for cover lookup, songs are printed in the same order */
+static int submit_cover(const struct mpd_song *song, void *data) {
+   coverpool *cp = data;
+   coverslot *slot;
+   char *line, *uric;
+
+   if (cp->tail - cp->head == COVER_WINDOW)
+      flush_cover(cp);
+
+   slot = &cp->slot[cp->tail % COVER_WINDOW];
+   if (!(line = song_line(song)) || !(slot->line = strdup(line)))
+      return RETURN_FAIL;
+   if (!(uric = strdup(mpd_song_get_uri(song))) || !(slot->dir = strdup(dirname(uric)))) {
+      if (uric) free(uric);
+      free(slot->line); slot->line = NULL;
+      return RETURN_FAIL;
+   }
+   free(uric);
+
+   pthread_mutex_lock(&cp->lock);
+   if (cp->ldir && !strcmp(cp->ldir, slot->dir)) {
+      slot->state = SLOT_SAME;
+   } else {
+      if (cp->ldir) free(cp->ldir);
+      cp->ldir = strdup(slot->dir);
+      slot->state = SLOT_PENDING;
+   }
+   cp->tail++;
+   pthread_cond_signal(&cp->work);
+   pthread_mutex_unlock(&cp->lock);
+   return RETURN_OK;
+}
+
+/* list queue with cover art, disk lookups overlap receiving from mpd */
+static int list_queue_covers(void) {
+   int ret;
+   pthread_t thread[COVER_THREADS];
+   coverpool *cp;
+
+   if (!(cp = calloc(1, sizeof(coverpool)))) {
+      MEMERR(coverpool);
+      return RETURN_FAIL;
+   }
+
+   pthread_mutex_init(&cp->lock, NULL);
+   pthread_cond_init(&cp->work, NULL);
+   pthread_cond_init(&cp->done, NULL);
+   for (cp->threads = 0; cp->threads != COVER_THREADS &&
+         !pthread_create(&thread[cp->threads], NULL, cover_worker, cp); ++cp->threads);
+
+   ret = walk_queue(submit_cover, NULL, cp, 0);
+   while (cp->head != cp->tail) flush_cover(cp);
+   stats_phase(PHASE_COVER);
+
+   pthread_mutex_lock(&cp->lock);
+   cp->quit = 1;
+   pthread_cond_broadcast(&cp->work);
+   pthread_mutex_unlock(&cp->lock);
+   while (cp->threads) pthread_join(thread[--cp->threads], NULL);
+
+   pthread_cond_destroy(&cp->done);
+   pthread_cond_destroy(&cp->work);
+   pthread_mutex_destroy(&cp->lock);
+   if (cp->lcover) free(cp->lcover);
+   if (cp->ldir) free(cp->ldir);
+   free(cp);
+   return ret;
+}
+
+/* add key by name to sort spec */
+static int add_sort_key(sortspec *spec, const char *name, size_t len) {
+   int t, k;
+   for (t = 0; formatTags[t].name; ++t) {
+      if (strlen(formatTags[t].name) != len) continue;
+      if (!strncmp(formatTags[t].name, name, len)) break;
+   }
+   if (!formatTags[t].name) {
+      ERR("Unknown sort key: %.*s", (int)len, name);
+      return RETURN_FAIL;
+   }
+   for (k = 0; k != spec->count && spec->key[k] != &formatTags[t]; ++k);
+   if (k == spec->count && spec->count != SORT_KEYS_MAX)
+      spec->key[spec->count++] = &formatTags[t];
+   return RETURN_OK;
+}
+
+/* parse comma separated sort keys, group key goes first */
+static int parse_sort(sortspec *spec, const char *sort, const char *group) {
+   size_t len;
+   memset(spec, 0, sizeof(sortspec));
+   spec->group = (group != NULL);
+   if (group && add_sort_key(spec, group, strlen(group)) != RETURN_OK)
+      return RETURN_FAIL;
+   for (; sort && *sort; sort += len + (sort[len] == ',')) {
+      len = strcspn(sort, ",");
+      if (len && add_sort_key(spec, sort, len) != RETURN_OK)
+         return RETURN_FAIL;
+   }
+   return RETURN_OK;
+}
+
+static int is_numeric_key(const fmttag *key) {
+   return (key->type == FMT_TAG && (key->tag == MPD_TAG_TRACK || key->tag == MPD_TAG_DISC));
+}
+
+/* grow every retained field of sorted listing */
+static int grow_sorted(sortlist *sl) {
+   unsigned int **field[SORT_KEYS_MAX+DICT_TAGS+4], *ids;
+   size_t size = (sl->size?sl->size*2:256);
+   int f, n = 0;
+
+   for (f = 0; f != sl->spec.count; ++f) field[n++] = &sl->key[f];
+   for (f = 0; f != DICT_TAGS; ++f)
+      if (sl->dictused & (1 << f)) field[n++] = &sl->tag[f];
+   field[n++] = &sl->line;
+   field[n++] = &sl->pos;
+   if (sl->spec.group) field[n++] = &sl->gline;
+   if (sl->printimg)   field[n++] = &sl->dir;
+   for (f = 0; f != n; ++f) {
+      if (!(ids = realloc(*field[f], size * sizeof(unsigned int)))) return RETURN_FAIL;
+      *field[f] = ids;
+   }
+   sl->size = size;
+   return RETURN_OK;
+}
+
+/* sort key of pooled value, folded once per distinct value */
+static unsigned int fold_key(sortlist *sl, unsigned int id) {
+   unsigned int *fold;
+   size_t size, f;
+
+   if (id >= sl->nfold) {
+      for (size = (sl->nfold?sl->nfold:256); size <= id; size *= 2);
+      if (!(fold = realloc(sl->fold, size * sizeof(unsigned int)))) return POOL_NONE;
+      for (f = sl->nfold; f != size; ++f) fold[f] = POOL_NONE;
+      sl->fold = fold; sl->nfold = size;
+   }
+   if (sl->fold[id] == POOL_NONE)
+      sl->fold[id] = pool_add(&sl->pool, line_key(pool_str(&sl->pool, id)));
+   return sl->fold[id];
+}
+
+/* ops of --format rendering the group key, album groups take the artist in
+ * front along, the label is then a substring of the song line */
+static void group_span(sortlist *sl) {
+   const fmttag *key = sl->spec.key[0];
+   const fmtop *op, *first;
+
+   sl->gfirst = sl->gend = NULL;
+   if (!format || !sl->spec.group) return;
+   for (op = format; op->type != FMT_END; ++op)
+      if (op->type == key->type && (op->type != FMT_TAG || op->tag == key->tag)) break;
+   if (op->type == FMT_END) return;
+
+   sl->gfirst = op; sl->gend = op+1;
+   if (key->type != FMT_ALBUM) return;
+   for (first = op; first != format && first[-1].type == FMT_LITERAL; --first);
+   if (first != format && first[-1].type == FMT_ARTIST) sl->gfirst = first-1;
+}
+
+static int dict_index(const fmttag *key) {
+   int d;
+   for (d = 0; d != DICT_TAGS; ++d)
+      if (dictTags[d].type == key->type && (key->type != FMT_TAG || dictTags[d].tag == key->tag)) break;
+   return d;
+}
+
+/* dictionary tags the sort and group keys read, album groups need the artist */
+static void dict_used(sortlist *sl) {
+   int k, d;
+   sl->dictused = 0;
+   for (k = 0; k != sl->spec.count; ++k)
+      if ((d = dict_index(sl->spec.key[k])) != DICT_TAGS) sl->dictused |= 1 << d;
+   if (sl->spec.group && sl->spec.key[0]->type == FMT_ALBUM)
+      sl->dictused |= (1 << DICT_ARTIST) | (1 << DICT_ALBUM);
+}
+
+/* extract sort keys of song once, tag values go to dictionary */
+static int collect_sorted(const struct mpd_song *song, void *data) {
+   sortlist *sl = data;
+   const fmttag *key;
+   const char *str;
+   char scratch[PATH_MAX], *line, *uric;
+   size_t i = sl->count;
+   int k, d;
+
+   if (sl->count == sl->size && grow_sorted(sl) != RETURN_OK)
+      return RETURN_FAIL;
+
+   /* rendered line is unique per song, appended without hashing */
+   sl->pos[i] = mpd_song_get_pos(song);
+   sl->line[i] = sl->lines.len;
+   if (!(line = song_line(song)) || sb_append(&sl->lines, line, strlen(line)+1) != RETURN_OK)
+      return RETURN_FAIL;
+
+   for (d = 0; d != DICT_TAGS; ++d) {
+      if (!(sl->dictused & (1 << d))) continue;
+      str = song_tag(song, dictTags[d].type, dictTags[d].tag, scratch);
+      if ((sl->tag[d][i] = pool_add(&sl->pool, (str?str:""))) == POOL_NONE)
+         return RETURN_FAIL;
+   }
+
+   for (k = 0; k != sl->spec.count; ++k) {
+      key = sl->spec.key[k];
+      if (is_numeric_key(key)) {
+         sl->key[k][i] = tag_number(song_tag(song, key->type, key->tag, scratch));
+      } else if ((d = dict_index(key)) != DICT_TAGS) {
+         if ((sl->key[k][i] = fold_key(sl, sl->tag[d][i])) == POOL_NONE)
+            return RETURN_FAIL;
+      } else {
+         str = song_tag(song, key->type, key->tag, scratch);
+         if ((sl->key[k][i] = pool_add(&sl->pool, line_key(str?str:""))) == POOL_NONE)
+            return RETURN_FAIL;
+      }
+   }
+
+   if (sl->spec.group) {
+      key = sl->spec.key[0];
+
+      /* album key keeps same titled albums of other artists apart,
+       * it is also the label of the default format */
+      if (key->type == FMT_ALBUM) {
+         sl->group.len = 0;
+         str = pool_str(&sl->pool, sl->tag[DICT_ARTIST][i]);
+         if (sb_append(&sl->group, str, strlen(str)) != RETURN_OK ||
+             sb_append(&sl->group, SEPERATOR, strlen(SEPERATOR)) != RETURN_OK)
+            return RETURN_FAIL;
+         str = pool_str(&sl->pool, sl->tag[DICT_ALBUM][i]);
+         if (sb_append(&sl->group, str, strlen(str)) != RETURN_OK ||
+             (sl->gline[i] = pool_add(&sl->pool, sl->group.data)) == POOL_NONE ||
+             (sl->key[0][i] = fold_key(sl, sl->gline[i])) == POOL_NONE)
+            return RETURN_FAIL;
+      }
+
+      /* otherwise label is the part of the song line showing the key, so play finds it */
+      if (sl->gfirst) {
+         sl->group.len = 0;
+         sb_append(&sl->group, "", 0);
+         render_ops(song, sl->gfirst, sl->gend, &sl->group, scratch);
+         if (!sl->group.data || (sl->gline[i] = pool_add(&sl->pool, sl->group.data)) == POOL_NONE)
+            return RETURN_FAIL;
+      } else if (key->type == FMT_ALBUM) {
+         if (format) sl->gline[i] = sl->tag[DICT_ALBUM][i]; /* album not in --format */
+      } else if ((d = dict_index(key)) != DICT_TAGS) {
+         sl->gline[i] = sl->tag[d][i];
+      } else {
+         str = song_tag(song, key->type, key->tag, scratch);
+         if ((sl->gline[i] = pool_add(&sl->pool, (str?str:""))) == POOL_NONE)
+            return RETURN_FAIL;
+      }
+   }
+
+   if (sl->printimg) {
+      if (!(uric = strdup(mpd_song_get_uri(song)))) return RETURN_FAIL;
+      sl->dir[i] = pool_add(&sl->pool, dirname(uric));
+      free(uric);
+      if (sl->dir[i] == POOL_NONE) return RETURN_FAIL;
+   }
+
+   sl->count++;
+   return RETURN_OK;
+}
+
+static const strpool *rankPool;
+static int rank_compare(const void *a, const void *b) {
+   return strcmp(pool_str(rankPool, *(const unsigned int*)a), pool_str(rankPool, *(const unsigned int*)b));
+}
+
+/* replace string key ids with their sorted rank, keys compare as numbers after */
+static int rank_keys(sortlist *sl) {
+   unsigned int *ids = NULL, *rank = NULL, n = 0, r;
+   char *seen = NULL;
+   size_t i;
+   int k, ret = RETURN_FAIL;
+
+   if (!sl->pool.count) return RETURN_OK;
+   if (!(seen = calloc(sl->pool.count, 1)) ||
+       !(ids  = malloc(sl->pool.count * sizeof(unsigned int))) ||
+       !(rank = malloc(sl->pool.count * sizeof(unsigned int))))
+      goto fail;
+
+   /* distinct values only, usually far fewer than songs */
+   for (k = 0; k != sl->spec.count; ++k) {
+      if (is_numeric_key(sl->spec.key[k])) continue;
+      for (i = 0; i != sl->count; ++i) {
+         if (seen[sl->key[k][i]]) continue;
+         seen[sl->key[k][i]] = 1;
+         ids[n++] = sl->key[k][i];
+      }
+   }
+
+   rankPool = &sl->pool;
+   qsort(ids, n, sizeof(unsigned int), rank_compare);
+   for (r = 0; r != n; ++r) rank[ids[r]] = r;
+
+   for (k = 0; k != sl->spec.count; ++k) {
+      if (is_numeric_key(sl->spec.key[k])) continue;
+      for (i = 0; i != sl->count; ++i) sl->key[k][i] = rank[sl->key[k][i]];
+   }
+   ret = RETURN_OK;
+
+fail:
+   if (seen) free(seen);
+   if (ids) free(ids);
+   if (rank) free(rank);
+   return ret;
+}
+
+/* compare keys from first to last, queue position last */
+static int sort_compare(const sortlist *sl, unsigned int a, unsigned int b) {
+   int k;
+   for (k = 0; k != sl->spec.count; ++k)
+      if (sl->key[k][a] != sl->key[k][b]) return (sl->key[k][a] < sl->key[k][b] ? -1 : 1);
+   return (sl->pos[a] < sl->pos[b] ? -1 : sl->pos[a] > sl->pos[b]);
+}
+
+/* bottom-up merge sort of song indices, no mpd round-trips or string compares */
+static int sort_songs(const sortlist *sl, unsigned int *order) {
+   unsigned int *tmp, *src = order, *dst, *swap;
+   size_t count = sl->count, width, i, l, r, lend, rend, o;
+
+   if (!(tmp = malloc(count * sizeof(unsigned int))))
+      return RETURN_FAIL;
+
+   for (dst = tmp, width = 1; width < count; width *= 2) {
+      for (i = 0; i < count; i += 2*width) {
+         l = i; lend = (i+width < count ? i+width : count);
+         r = lend; rend = (i+2*width < count ? i+2*width : count);
+         for (o = i; l < lend && r < rend; ++o)
+            dst[o] = (sort_compare(sl, src[r], src[l]) < 0 ? src[r++] : src[l++]);
+         while (l < lend) dst[o++] = src[l++];
+         while (r < rend) dst[o++] = src[r++];
+      }
+      swap = src; src = dst; dst = swap;
+   }
+
+   if (src != order) memcpy(order, src, count * sizeof(unsigned int));
+   free(tmp);
+   return RETURN_OK;
+}
+
+/* list queue sorted, optionally collapsed to groups */
+static int list_sorted(const char *sort, const char *group, int printimg) {
+   sortlist sl;
+   unsigned int *order = NULL, s, last = 0, ldir = POOL_NONE;
+   char *cover = NULL;
+   size_t i;
+   int k, ret = RETURN_FAIL;
+
+   memset(&sl, 0, sizeof(sortlist));
+   sl.printimg = printimg;
+   if (parse_sort(&sl.spec, sort, group) != RETURN_OK)
+      goto fail;
+   group_span(&sl);
+   dict_used(&sl);
+   if (walk_queue(collect_sorted, NULL, &sl, 0) != RETURN_OK ||
+       rank_keys(&sl) != RETURN_OK)
+      goto fail;
+
+   if (sl.count && !(order = malloc(sl.count * sizeof(unsigned int))))
+      goto fail;
+   for (i = 0; i != sl.count; ++i) order[i] = i;
+   if (sort_songs(&sl, order) != RETURN_OK)
+      goto fail;
+   stats_phase(PHASE_SORT);
+
+   for (i = 0; i != sl.count; ++i) {
+      s = order[i];
+      if (sl.spec.group && i && sl.key[0][s] == sl.key[0][last])
+         continue;
+      last = s;
+
+      if (printimg && ldir != sl.dir[s]) {
+         if (cover) free(cover);
+         stats_phase(PHASE_COMMAND);
+         cover = fetch_cover(pool_str(&sl.pool, sl.dir[s]));
+         stats_phase(PHASE_COVER);
+         ldir = sl.dir[s];
+      } else if (printimg) STAT(coverhits);
+      print_line((sl.spec.group ? pool_str(&sl.pool, sl.gline[s]) : sl.lines.data + sl.line[s]), cover);
+   }
+   ret = RETURN_OK;
+
+fail:
+   for (k = 0; k != sl.spec.count; ++k)
+      if (sl.key[k]) free(sl.key[k]);
+   for (k = 0; k != DICT_TAGS; ++k)
+      if (sl.tag[k]) free(sl.tag[k]);
+   if (sl.fold)  free(sl.fold);
+   if (sl.line)  free(sl.line);
+   if (sl.gline) free(sl.gline);
+   if (sl.dir)   free(sl.dir);
+   if (sl.pos)   free(sl.pos);
+   if (sl.group.data) free(sl.group.data);
+   if (sl.lines.data) free(sl.lines.data);
+   if (order) free(order);
+   if (cover) free(cover);
+   free_pool(&sl.pool);
+   return ret;
+}
+
+/* list queue */
+static int list_queue(int printimg) {
+   if (printimg) return list_queue_covers();
+   return walk_queue(list_song, NULL, NULL, 0);
+}
+
+typedef struct searchdata {
+   mpdquery query;
+   char *line;
+   int id;
+} searchdata;
+
+static int search_entry(const queueentry *entry, void *data) {
+   int exact;
+   searchdata *sd = data;
+   if (match_line(&sd->query, entry->line, entry->key, &exact) != RETURN_OK)
+      return RETURN_OK;
+   sd->id = entry->id;
+   sd->line = strdup(entry->line);
+   return RETURN_STOP;
+}
+
+/* search queue, returns id of first match and its line */
+static int search_queue(const char *needle, char **line) {
+   searchdata sd;
+   sd.id = -1; sd.line = NULL;
+
+   if (init_query(&sd.query, needle) == RETURN_OK)
+      walk_queue(NULL, search_entry, &sd, 1);
+
+   free_query(&sd.query);
+   if (sd.id >= 0 && !sd.line) sd.id = -1;
+   *line = sd.line;
+   return sd.id;
+}
+
+/* coalesced position ranges */
+typedef struct mpdranges {
+   unsigned int (*range)[2];
+   size_t count, size;
+} mpdranges;
+
+/* add position to ranges, extends last range when contiguous */
+static int add_range(mpdranges *r, unsigned int pos) {
+   unsigned int (*range)[2];
+   size_t size;
+   if (r->count && r->range[r->count-1][1] == pos) {
+      r->range[r->count-1][1] = pos+1;
+      return RETURN_OK;
+   }
+   if (r->count == r->size) {
+      size = (r->size?r->size*2:32);
+      if (!(range = realloc(r->range, size * sizeof(*range)))) return RETURN_FAIL;
+      r->range = range; r->size = size;
+   }
+   r->range[r->count][0] = pos;
+   r->range[r->count][1] = pos+1;
+   r->count++;
+   return RETURN_OK;
+}
+
+typedef struct filterdata {
+   mpdquery query;
+   mpdranges ranges;
+   int keep;
+   unsigned int removed, matched;
+} filterdata;
+
+static int filter_entry(const queueentry *entry, void *data) {
+   filterdata *fd = data;
+   int match = (match_line(&fd->query, entry->line, entry->key, NULL) == RETURN_OK);
+   fd->matched += match;
+   if (match == fd->keep) return RETURN_OK;
+   if (add_range(&fd->ranges, entry->pos) != RETURN_OK) return RETURN_FAIL;
+   fd->removed++;
+   return RETURN_OK;
+}
+
+/* drop matching (or keep only matching) songs from queue, positions to
+ * delete always come from mpd, never from the queue cache */
+static int filter_queue(const char *needle, int keep) {
+   size_t i;
+   int ret = RETURN_FAIL;
+   filterdata fd;
+   memset(&fd, 0, sizeof(filterdata));
+   fd.keep = keep;
+
+   if (init_query(&fd.query, needle) != RETURN_OK) {
+      ERR("Could not filter playlist, nothing removed");
+      goto fail;
+   }
+
+   /* empty key is found in every line, would remove all or nothing */
+   if (!fd.query.tokc) {
+      ERR("Empty filter, nothing removed");
+      goto fail;
+   }
+
+   if (walk_queue(NULL, filter_entry, &fd, 0) != RETURN_OK) {
+      ERR("Could not filter playlist, nothing removed");
+      goto fail;
+   }
+
+   /* likely a typo, keeping nothing would clear the whole queue */
+   if (keep && !fd.matched) {
+      printf("no match for: %s, nothing removed\n", needle);
+      goto fail;
+   }
+
+   /* highest range first, so positions of the rest stay valid */
+   if (fd.ranges.count) {
+      if (!mpd_command_list_begin(mpd->connection, false))
+         goto mpd_error;
+      for (i = fd.ranges.count; i > 0; --i)
+         mpd_send_delete_range(mpd->connection, fd.ranges.range[i-1][0], fd.ranges.range[i-1][1]);
+      if (!MPDRT(mpd_command_list_end(mpd->connection)) ||
+          !mpd_response_finish(mpd->connection))
+         goto mpd_error;
+   }
+   stats_phase(PHASE_EDIT);
+
+   printf(">> removed %u song(s) in %zu range(s)\n", fd.removed, fd.ranges.count);
+   ret = RETURN_OK;
+   goto fail;
+
+mpd_error:
+   MPDERR();
+fail:
+   if (fd.ranges.range) free(fd.ranges.range);
+   free_query(&fd.query);
+   return ret;
+}
+
+/* queue snapshot for sync */
+typedef struct syncqueue {
+   unsigned int *id;
+   char **uri;
+   size_t count, size;
+} syncqueue;
+
+static int collect_song(const struct mpd_song *song, void *data) {
+   syncqueue *sq = data;
+   unsigned int *id;
+   char **uri;
+   size_t size;
+   if (sq->count == sq->size) {
+      size = (sq->size?sq->size*2:256);
+      if (!(id = realloc(sq->id, size * sizeof(unsigned int)))) return RETURN_FAIL;
+      sq->id = id;
+      if (!(uri = realloc(sq->uri, size * sizeof(char*)))) return RETURN_FAIL;
+      sq->uri = uri; sq->size = size;
+   }
+   if (!(sq->uri[sq->count] = strdup(mpd_song_get_uri(song)))) return RETURN_FAIL;
+   sq->id[sq->count++] = mpd_song_get_id(song);
+   return RETURN_OK;
+}
+
+/* read .m3u/.m3u8/.pls entries as uris relative to MUSIC_DIR,
+ * NULL unless the whole file was read, a partial list would delete the rest */
+static char** read_playlist(const char *path, const char *dir, size_t *count) {
+   FILE *f;
+   struct stat st;
+   char *line = NULL, *entry, **uris = NULL, **tmp;
+   const char *ext = strrchr(path, '.');
+   size_t size = 0, alloc = 0, len, i;
+   int pls, t, fail = 0;
+   ssize_t read;
+
+   *count = 0;
+   for (t = 0; ext && syncFormats[t] && strcmp(ext, syncFormats[t]); ++t);
+   if (!ext || !syncFormats[t]) {
+      ERR("Not a .m3u/.m3u8/.pls playlist: %s", path);
+      return NULL;
+   }
+   pls = !strcmp(ext, ".pls");
+
+   if (!(f = fopen(path, "r")))
+      return NULL;
+   if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)) {
+      ERR("Not a regular file: %s", path);
+      fclose(f);
+      return NULL;
+   }
+
+   while ((read = getline(&line, &size, f)) > 0) {
+      line[strcspn(line, "\r\n")] = 0;
+      entry = line;
+      if (pls) {
+         if (strncmp(entry, "File", 4) || !(entry = strchr(entry, '='))) continue;
+         ++entry;
+      } else if (*entry == '#') continue;
+      if (!*entry) continue;
+
+      if (*count == alloc) {
+         alloc = (alloc?alloc*2:256);
+         if (!(tmp = realloc(uris, alloc * sizeof(char*)))) {
+            fail = 1;
+            break;
+         }
+         uris = tmp;
+      }
+
+      /* urls and absolute paths outside MUSIC_DIR go as is */
+      if (strstr(entry, "://") || (*entry == '/' &&
+          (strncmp(entry, MUSIC_DIR"/", strlen(MUSIC_DIR)+1)))) {
+         uris[*count] = strdup(entry);
+      } else if (*entry == '/') {
+         uris[*count] = strdup(entry+strlen(MUSIC_DIR)+1);
+      } else if (!strcmp(dir, ".")) {
+         uris[*count] = strdup(entry);
+      } else if ((uris[*count] = malloc((len = strlen(dir)+1+strlen(entry)+1)))) {
+         snprintf(uris[*count], len, "%s/%s", dir, entry);
+      }
+      if (!uris[*count]) {
+         fail = 1;
+         break;
+      }
+      ++*count;
+   }
+
+   if (ferror(f)) fail = 1;
+   if (line) free(line);
+   fclose(f);
+   if (!fail && !uris && !(uris = calloc(1, sizeof(char*)))) /* empty playlist */
+      fail = 1;
+   if (fail) {
+      for (i = 0; i != *count; ++i) free(uris[i]);
+      if (uris) free(uris);
+      *count = 0;
+      return NULL;
+   }
+   return uris;
+}
+
+/* longest increasing run of matched queue indices, marks kept targets */
+static void mark_lis(const int *match, size_t count, char *keep) {
+   size_t i, lo, hi, mid, len = 0;
+   int *tail, *prev, k;
+
+   if (!(tail = malloc(count * sizeof(int))) || !(prev = malloc(count * sizeof(int)))) {
+      if (tail) free(tail);
+      return;
+   }
+
+   for (i = 0; i != count; ++i) {
+      prev[i] = -1;
+      if (match[i] < 0) continue;
+      for (lo = 0, hi = len; lo < hi;) {
+         mid = (lo+hi)/2;
+         if (match[tail[mid]] < match[i]) lo = mid+1;
+         else hi = mid;
+      }
+      if (lo) prev[i] = tail[lo-1];
+      tail[lo] = i;
+      if (lo == len) ++len;
+   }
+
+   for (k = (len?tail[len-1]:-1); k >= 0; k = prev[k])
+      keep[k] = 1;
+
+   free(tail);
+   free(prev);
+}
+
+/* fenwick tree counting occupied slots */
+static void fw_add(int *tree, size_t size, size_t slot, int v) {
+   for (++slot; slot <= size; slot += slot & -slot) tree[slot-1] += v;
+}
+
+/* occupied slots before slot */
+static size_t fw_before(const int *tree, size_t slot) {
+   size_t n = 0;
+   for (; slot; slot -= slot & -slot) n += tree[slot-1];
+   return n;
+}
+
+/* add missing entries in own command lists, a stale entry only skips itself */
+static size_t sync_adds(char **uris, const int *match, size_t count) {
+   size_t i, j, added = 0, skipped = 0;
+
+   for (i = 0; i != count;) {
+      if (!mpd_command_list_begin(mpd->connection, true))
+         break;
+      for (j = i; j != count; ++j)
+         if (match[j] < 0) mpd_send_add_id_to(mpd->connection, uris[j], j-skipped);
+      if (!MPDRT(mpd_command_list_end(mpd->connection)))
+         break;
+
+      for (; i != count; ++i) {
+         if (match[i] >= 0) continue;
+         if (mpd_recv_song_id(mpd->connection) < 0) break;
+         mpd_response_next(mpd->connection);
+         ++added;
+      }
+      if (i == count) {
+         if (!mpd_response_finish(mpd->connection)) MPDERR();
+         break;
+      }
+
+      /* list stopped at entry i, later ones were not run */
+      ERR("Could not add %s: %s", uris[i], mpd_connection_get_error_message(mpd->connection));
+      if (!mpd_connection_clear_error(mpd->connection))
+         break;
+      ++skipped; ++i;
+   }
+   MPDERR();
+   return added;
+}
+
+/* turn queue into playlist with minimal deleteid/moveid/addid */
+static int sync_queue(char **uris, size_t count) {
+   syncqueue sq;
+   size_t i, q, g, tsize, slots, kept = 0, deleted = 0, moved = 0, added = 0, missing;
+   size_t *slot = NULL, *cstart = NULL, *ostart = NULL;
+   int *match = NULL, *next = NULL, *table = NULL, *tree = NULL, h;
+   char *used = NULL, *keep = NULL;
+   int ret = RETURN_FAIL;
+
+   memset(&sq, 0, sizeof(syncqueue));
+   stats_phase(PHASE_COMMAND);
+   if (foreach_queue(collect_song, &sq) != RETURN_OK)
+      goto fail;
+   stats_phase(PHASE_RECEIVE);
+
+   for (tsize = 16; tsize < sq.count*2; tsize *= 2);
+   if (!(match = malloc((count+1) * sizeof(int))) ||
+       !(keep  = calloc(count+1, 1)) ||
+       !(next  = malloc((sq.count+1) * sizeof(int))) ||
+       !(used  = calloc(sq.count+1, 1)) ||
+       !(slot  = malloc((sq.count+1) * sizeof(size_t))) ||
+       !(table = malloc(tsize * sizeof(int))))
+      goto fail;
+
+   /* uri -> queue indices, duplicates chained in queue order */
+   memset(table, -1, tsize * sizeof(int));
+   for (i = sq.count; i > 0; --i) {
+      for (h = _hash(sq.uri[i-1]) & (tsize-1);
+           table[h] >= 0 && strcmp(sq.uri[table[h]], sq.uri[i-1]); h = (h+1) & (tsize-1));
+      next[i-1] = table[h];
+      table[h] = i-1;
+   }
+
+   /* match playlist entries to first unused queue entry with same uri */
+   for (i = 0; i != count; ++i) {
+      for (h = _hash(uris[i]) & (tsize-1);
+           table[h] >= 0 && strcmp(sq.uri[table[h]], uris[i]); h = (h+1) & (tsize-1));
+      for (match[i] = table[h]; match[i] >= 0 && used[match[i]]; match[i] = next[match[i]]);
+      if (match[i] >= 0) used[match[i]] = 1;
+   }
+   mark_lis(match, count, keep);
+   for (i = 0; i != count; ++i)
+      if (keep[i]) used[match[i]] = 2, ++kept;
+
+   /* queue is laid out in slots, each gap after a kept entry holds the
+    * kept entry, entries moved behind it in playlist order, then entries
+    * not moved yet. position of an entry is occupied slots before it. */
+   if (!(cstart = calloc(kept+1, sizeof(size_t))) || !(ostart = calloc(kept+1, sizeof(size_t))))
+      goto fail;
+   for (g = 0, i = 0; i != count; ++i) {
+      if (match[i] < 0) continue;
+      if (keep[i]) ++g;
+      else ++cstart[g];
+   }
+   for (g = 0, q = 0; q != sq.count; ++q) {
+      if (used[q] == 2) ++g;
+      else if (used[q]) ++ostart[g];
+   }
+   for (slots = 0, g = 0; g <= kept; ++g) {
+      slots += (g != 0);
+      i = cstart[g]; cstart[g] = slots; slots += i;
+      i = ostart[g]; ostart[g] = slots; slots += i;
+   }
+   if (!(tree = calloc(slots+1, sizeof(int))))
+      goto fail;
 
-/* printf wrapper */
-static void _prnt(FILE *out, const char *fmt, ...) {
-   va_list args;
-   char buffer[LINE_MAX];
+   stats_phase(PHASE_COMMAND);
+   if (!mpd_command_list_begin(mpd->connection, false))
+      goto mpd_error;
 
-   memset(buffer, 0, LINE_MAX);
-   va_start(args, fmt);
-   vsnprintf(buffer, LINE_MAX-1, fmt, args);
-   va_end(args);
-   _cprnt(out, buffer);
-}
+   /* drop what is not in playlist */
+   for (g = 0, q = 0; q != sq.count; ++q) {
+      if (!used[q]) {
+         mpd_send_delete_id(mpd->connection, sq.id[q]);
+         ++deleted;
+         continue;
+      }
+      if (used[q] == 2) slot[q] = cstart[++g]-1;
+      else slot[q] = ostart[g]++;
+      fw_add(tree, slots, slot[q], 1);
+   }
 
-/* get mpd status */
-static struct mpd_status * get_status(void) {
-   struct mpd_status *status;
-   assert(mpd->connection);
+   /* move entries off the kept run right after their predecessor */
+   for (g = 0, i = 0; i != count; ++i) {
+      if (match[i] < 0) continue;
+      if (keep[i]) {
+         ++g;
+         continue;
+      }
+      fw_add(tree, slots, slot[match[i]], -1);
+      slot[match[i]] = cstart[g]++;
+      mpd_send_move_id(mpd->connection, sq.id[match[i]], fw_before(tree, slot[match[i]]));
+      fw_add(tree, slots, slot[match[i]], 1);
+      ++moved;
+   }
 
-   if (!(status = mpd_recv_status(mpd->connection)))
+   if (!MPDRT(mpd_command_list_end(mpd->connection)) ||
+       !mpd_response_finish(mpd->connection))
       goto mpd_error;
-   if (mpd->status) mpd_status_free(mpd->status);
-   return mpd->status = status;
+
+   /* queue now has playlist order, insert missing entries in place */
+   added = sync_adds(uris, match, count);
+   stats_phase(PHASE_EDIT);
+   for (missing = 0, i = 0; i != count; ++i)
+      if (match[i] < 0) ++missing;
+
+   printf(">> synced: %zu deleted, %zu moved, %zu added", deleted, moved, added);
+   if (added != missing) printf(", %zu not found", missing-added);
+   putchar('\n');
+   ret = RETURN_OK;
+   goto fail;
 
 mpd_error:
    MPDERR();
-   return NULL;
+fail:
+   for (i = 0; i != sq.count; ++i) free(sq.uri[i]);
+   if (sq.uri)  free(sq.uri);
+   if (sq.id)   free(sq.id);
+   if (match)   free(match);
+   if (keep)    free(keep);
+   if (next)    free(next);
+   if (used)    free(used);
+   if (slot)    free(slot);
+   if (cstart)  free(cstart);
+   if (ostart)  free(ostart);
+   if (tree)    free(tree);
+   if (table)   free(table);
+   return ret;
 }
 
-/* fetch cover art */
-static char* fetch_cover(const char *dir) {
-   struct dirent **names; size_t len, n, i;
-   char rdir[PATH_MAX], fcover[256], *cover;
+/* read mirror header, leaves file at first record */
+static int read_db_stamp(FILE *f, unsigned long *stamp) {
+   char header[64];
+   unsigned long hash;
+   int kana;
+   if (!fgets(header, sizeof(header), f)) return RETURN_FAIL;
+   if (sscanf(header, DB_MAGIC" %lu %lx %d", stamp, &hash, &kana) != 3) return RETURN_FAIL;
+   if (hash != formatHash) return RETURN_FAIL; /* lines were made with other --format */
+   if (kana != FOLD_KANA) return RETURN_FAIL; /* keys were folded differently */
+   return RETURN_OK;
+}
 
-   memset(rdir, 0, sizeof(rdir));
-   memset(fcover, 0, sizeof(fcover));
-   snprintf(rdir, sizeof(rdir)-1, "%s/%s", MUSIC_DIR, dir);
-   if (!(n = scandir(rdir, &names, 0, alphasort)) || n == -1)
-      return NULL;
-   for (i = 0; i != n; ++i) {
-      if (names[i]->d_type != DT_REG) continue;
-      if (!_strupstr(names[i]->d_name, ".jpg") &&
-          !_strupstr(names[i]->d_name, ".png")) continue;
+/* mirror records by uri, rest is "line\tkey" */
+typedef struct dbrecords {
+   char **uri, **rest;
+   int *table;
+   size_t count, size, tsize;
+} dbrecords;
+
+static int db_add(dbrecords *r, char *uri, char *rest) {
+   char **tmp;
+   size_t size;
+   if (r->count == r->size) {
+      size = (r->size?r->size*2:1024);
+      if (!(tmp = realloc(r->uri, size * sizeof(char*)))) return RETURN_FAIL;
+      r->uri = tmp;
+      if (!(tmp = realloc(r->rest, size * sizeof(char*)))) return RETURN_FAIL;
+      r->rest = tmp;
+      r->size = size;
+   }
+   r->uri[r->count] = uri;
+   r->rest[r->count++] = rest;
+   return RETURN_OK;
+}
 
-      strncpy(fcover, names[i]->d_name, sizeof(fcover)-1);
-      break;
+/* hash uris once all records are in */
+static int db_index(dbrecords *r) {
+   size_t i, h;
+   for (r->tsize = 16; r->tsize < r->count*2; r->tsize *= 2);
+   if (!(r->table = malloc(r->tsize * sizeof(int)))) return RETURN_FAIL;
+   memset(r->table, -1, r->tsize * sizeof(int));
+   for (i = 0; i != r->count; ++i) {
+      for (h = _hash(r->uri[i]) & (r->tsize-1); r->table[h] >= 0; h = (h+1) & (r->tsize-1));
+      r->table[h] = i;
    }
-   for (i = 0; i != n; ++i) free(names[i]);
-   free(names);
+   return RETURN_OK;
+}
 
-   if (!strlen(fcover))
-      return NULL;
+static const char* db_find(const dbrecords *r, const char *uri) {
+   size_t h;
+   if (!r->table) return NULL;
+   for (h = _hash(uri) & (r->tsize-1); r->table[h] >= 0; h = (h+1) & (r->tsize-1))
+      if (!strcmp(r->uri[r->table[h]], uri)) return r->rest[r->table[h]];
+   return NULL;
+}
+
+/* owned records are single allocations starting at uri */
+static void db_free(dbrecords *r, int owned) {
+   size_t i;
+   if (owned) for (i = 0; i != r->count; ++i) free(r->uri[i]);
+   if (r->uri)   free(r->uri);
+   if (r->rest)  free(r->rest);
+   if (r->table) free(r->table);
+   memset(r, 0, sizeof(dbrecords));
+}
 
-   len = strlen(rdir)+1+strlen(fcover)+2;
-   if (!(cover = calloc(1, len)))
+/* load records of current mirror, f is at first record */
+static char* load_db(FILE *f, dbrecords *r) {
+   struct stat st;
+   char *data, *c, *nl, *tab;
+   size_t len;
+   long off = ftell(f);
+
+   if (off < 0 || fstat(fileno(f), &st) != 0 || st.st_size < off) return NULL;
+   len = st.st_size - off;
+   if (!(data = malloc(len+1))) return NULL;
+   if (fread(data, 1, len, f) != len) {
+      free(data);
       return NULL;
+   }
+   data[len] = 0;
+
+   for (c = data; *c; c = nl+1) {
+      if (!(nl = strchr(c, '\n'))) break;
+      *nl = 0;
+      if (!(tab = strchr(c, '\t'))) continue;
+      *tab = 0;
+      if (db_add(r, c, tab+1) != RETURN_OK) {
+         db_free(r, 0);
+         free(data);
+         return NULL;
+      }
+   }
+   return data;
+}
 
-   snprintf(cover, len-1, "%s/%s", rdir, fcover);
-   return cover;
+/* render "line\tkey" of song, fails for uris that can't be stored */
+static int db_record(const struct mpd_song *song, strbuf *sb) {
+   char *line, *c;
+   if (strpbrk(mpd_song_get_uri(song), "\t\n") || !(line = song_line(song)))
+      return RETURN_FAIL;
+   for (c = line; (c = strpbrk(c, "\t\n")); ) *c = ' ';
+   sb->len = 0;
+   if (sb_append(sb, line, strlen(line)) != RETURN_OK || sb_append(sb, "\t", 1) != RETURN_OK)
+      return RETURN_FAIL;
+   line = line_key(line);
+   return sb_append(sb, line, strlen(line));
 }
 
-/* get cover art for song */
-static char* get_cover_art(const struct mpd_song *song) {
-   char *uric, *ret; const char *uri, *urid;
-   if (!song || !(uri = mpd_song_get_uri(song)) || !((uric = strdup(uri))))
-      return NULL;
-   urid = dirname(uric);
-   ret = fetch_cover(urid);
-   free(uric);
-   return ret;
+/* private temporary mirror with header */
+static FILE* open_db(char *tmp, size_t size, unsigned long stamp) {
+   FILE *f;
+   if (!(f = create_cache(DB_CACHE, tmp, size))) return NULL;
+   fprintf(f, DB_MAGIC" %lu %lx %d\n", stamp, formatHash, FOLD_KANA);
+   return f;
 }
 
-/* add song to queue */
-static int print_song(const struct mpd_song *song, const char *sep, int printimg) {
-   if (!song) return RETURN_FAIL;
-   char *basec = NULL, *based = NULL, *cover = NULL;
-   static char *lalbum = NULL;
-   static char *lcover = NULL;
-   const char *disc    = mpd_song_get_tag(song, MPD_TAG_DISC, 0);
-   const char *track   = mpd_song_get_tag(song, MPD_TAG_TRACK, 0);
-   const char *comment = mpd_song_get_tag(song, MPD_TAG_COMMENT, 0);
-   const char *genre   = mpd_song_get_tag(song, MPD_TAG_GENRE, 0);
-   const char *album   = mpd_song_get_tag(song, MPD_TAG_ALBUM, 0);
-   const char *title   = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
-   const char *artist  = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0);
-   if (!title)  title  = mpd_song_get_tag(song, MPD_TAG_NAME, 0);
-   if (!artist) artist = mpd_song_get_tag(song, MPD_TAG_ALBUM_ARTIST, 0);
-   if (!artist) artist = mpd_song_get_tag(song, MPD_TAG_COMPOSER, 0);
-   if (!artist) artist = mpd_song_get_tag(song, MPD_TAG_PERFORMER, 0);
-   if (!album && (based = strdup(mpd_song_get_uri(song)))) album = basename(dirname(based));
-   if (!title && (basec = strdup(mpd_song_get_uri(song)))) title = basename(basec);
-
-   /* fallbacks */
-   if (!artist) artist = "noartist";
-   if (!album)  album  = "noalbum";
-   if (!title)  title  = "notitle";
-
-#if 0
-   OUT("URI:    %s", mpd_song_get_uri(song));
-   OUT("Song [%d]: d:%d s:%d e:%d m:%lu q:%d",
-         mpd_song_get_id(song),
-         mpd_song_get_duration(song),
-         mpd_song_get_start(song),
-         mpd_song_get_end(song),
-         mpd_song_get_last_modified(song),
-         mpd_song_get_pos(song));
-   OUT("D[%s] T[%s]", disc, track);
-   OUT("GENRE:  %s", genre);
-   OUT("ARTIST: %s", artist);
-   OUT("ALBUM:  %s", album);
-   OUT("TITLE:  %s", title);
-#else
-   if (artist && album && title) {
-      if (printimg) {
-         if (lcover && !strcmp(lalbum, album)) {
-            cover = strdup(lcover);
-         } else cover = get_cover_art(song);
-         if (cover) printf("IMG:%s\t", cover);
+/* write mirror of mpd database, one "uri\tline\tkey" record per song */
+static int write_db(unsigned long stamp) {
+   FILE *f;
+   char tmp[PATH_MAX];
+   const struct mpd_song *song;
+   struct mpd_entity *entity;
+   strbuf sb;
+
+   memset(&sb, 0, sizeof(strbuf));
+   if (!(f = open_db(tmp, sizeof(tmp), stamp)))
+      goto open_fail;
+
+   if (!MPDRT(mpd_send_list_all_meta(mpd->connection, "")))
+      goto mpd_error;
+
+   while ((entity = mpd_recv_entity(mpd->connection))) {
+      STAT(entities);
+      if (mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
+         song = mpd_entity_get_song(entity);
+         stats_song(song);
+         if (db_record(song, &sb) == RETURN_OK)
+            fprintf(f, "%s\t%s\n", mpd_song_get_uri(song), sb.data);
       }
-      printf("%s%s%s%s%s\n", artist, sep, album, sep, title);
+      mpd_entity_free(entity);
    }
-#endif
 
-   /* remember last album && cover */
-   if (lalbum) free(lalbum);
-   if (lcover) free(lcover);
-   if (album) lalbum = strdup(album);
-   else lalbum = NULL;
-   if (cover) {
-      lcover = strdup(cover);
-      free(cover);
-   } else lcover = NULL;
+   if (!mpd_response_finish(mpd->connection))
+      goto mpd_error;
 
-   if (based) free(based);
-   if (basec) free(basec);
+   if (sb.data) free(sb.data);
+   if (commit_cache(f, tmp, DB_CACHE) != RETURN_OK)
+      goto open_fail;
    return RETURN_OK;
+
+mpd_error:
+   MPDERR();
+   if (sb.data) free(sb.data);
+   fclose(f);
+   unlink(tmp);
+   return RETURN_FAIL;
+open_fail:
+   ERR("Could not write database mirror: %s", DB_CACHE);
+   return RETURN_FAIL;
 }
 
-/* match song from queue */
-static int match_song(const struct mpd_song *song, const char *needle, const char *sep, int *exact) {
-   if (exact) *exact = 0;
-   if (!song) return RETURN_FAIL;
-   char *basec = NULL, *based = NULL;
-   const char *disc    = mpd_song_get_tag(song, MPD_TAG_DISC, 0);
-   const char *track   = mpd_song_get_tag(song, MPD_TAG_TRACK, 0);
-   const char *comment = mpd_song_get_tag(song, MPD_TAG_COMMENT, 0);
-   const char *genre   = mpd_song_get_tag(song, MPD_TAG_GENRE, 0);
-   const char *album   = mpd_song_get_tag(song, MPD_TAG_ALBUM, 0);
-   const char *title   = mpd_song_get_tag(song, MPD_TAG_TITLE, 0);
-   const char *artist  = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0);
-   if (!title)  title  = mpd_song_get_tag(song, MPD_TAG_NAME, 0);
-   if (!artist) artist = mpd_song_get_tag(song, MPD_TAG_ALBUM_ARTIST, 0);
-   if (!artist) artist = mpd_song_get_tag(song, MPD_TAG_COMPOSER, 0);
-   if (!artist) artist = mpd_song_get_tag(song, MPD_TAG_PERFORMER, 0);
-   if (!album && (based = strdup(mpd_song_get_uri(song)))) album = basename(dirname(based));
-   if (!title && (basec = strdup(mpd_song_get_uri(song)))) title = basename(basec);
-
-   /* fallbacks */
-   if (!artist) artist = "noartist";
-   if (!album)  album  = "noalbum";
-   if (!title)  title  = "notitle";
-
-   if (!album || !artist || !title) {
-      if (based) free(based);
-      if (basec) free(basec);
+/* receive songs of pending command as owned records */
+static int recv_records(dbrecords *r, strbuf *sb) {
+   struct mpd_song *song;
+   char *rec;
+   size_t len;
+   int ret = RETURN_OK;
+
+   while ((song = mpd_recv_song(mpd->connection))) {
+      STAT(entities);
+      stats_song(song);
+      if (ret == RETURN_OK && db_record(song, sb) == RETURN_OK) {
+         len = strlen(mpd_song_get_uri(song));
+         if (!(rec = malloc(len+1+sb->len+1))) ret = RETURN_FAIL;
+         else {
+            memcpy(rec, mpd_song_get_uri(song), len+1);
+            memcpy(rec+len+1, sb->data, sb->len+1);
+            if (db_add(r, rec, rec+len+1) != RETURN_OK) {
+               free(rec);
+               ret = RETURN_FAIL;
+            }
+         }
+      }
+      mpd_song_free(song);
+   }
+   if (!mpd_response_finish(mpd->connection)) {
+      MPDERR();
       return RETURN_FAIL;
    }
+   return ret;
+}
+
+/* update mirror from songs modified since last sync, uri-only listall
+ * drops deleted songs and keeps database order */
+static int update_db(const dbrecords *old, unsigned long since, unsigned long stamp) {
+   FILE *f = NULL;
+   char tmp[PATH_MAX], **missing = NULL, **mtmp;
+   const char *rest;
+   const struct mpd_song *song;
+   struct mpd_entity *entity;
+   dbrecords changed, added;
+   strbuf sb;
+   size_t count = 0, size = 0, i;
+   int oom = 0, ret = RETURN_FAIL;
+
+   memset(&changed, 0, sizeof(dbrecords));
+   memset(&added, 0, sizeof(dbrecords));
+   memset(&sb, 0, sizeof(strbuf));
+
+   if (!mpd_search_db_songs(mpd->connection, false) ||
+       !mpd_search_add_modified_since_constraint(mpd->connection, MPD_OPERATOR_DEFAULT, since) ||
+       !MPDRT(mpd_search_commit(mpd->connection))) {
+      mpd_search_cancel(mpd->connection);
+      goto mpd_error;
+   }
+   if (recv_records(&changed, &sb) != RETURN_OK || db_index(&changed) != RETURN_OK)
+      goto fail;
+
+   if (!(f = open_db(tmp, sizeof(tmp), stamp)))
+      goto fail;
+
+   if (!MPDRT(mpd_send_list_all(mpd->connection, "")))
+      goto mpd_error;
 
-   char found  = 0, *whole = NULL;
-   size_t lsep = strlen(sep);
-   size_t len  = strlen(artist)+lsep+strlen(album)+lsep+strlen(title)+2;
-   if ((whole = malloc(len))) {
-      snprintf(whole, len-1, "%s%s%s%s%s", artist, sep, album, sep, title);
-      if (based) free(based);
-      if (basec) free(basec);
-      if (!strcmp(needle, whole)) {
-         found = 1;
-         if (exact) *exact = 1;
-      } else if (_strupstr(whole, needle))
-         found = 1;
-
-      if (!found) {
-         int tokc = 0;
-         char *cpy = strdup(needle);
-         if (cpy) {
-            char *tok = strtok(cpy, " ");
-            while (tok) {
-               if (!strcmp(tok, whole)) {
-                  found++;
-               } else if (_strupstr(whole, tok))
-                  found++;
-               tok = strtok(NULL, " ");
-               ++tokc;
+   while ((entity = mpd_recv_entity(mpd->connection))) {
+      STAT(entities);
+      if (mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
+         song = mpd_entity_get_song(entity);
+         stats_song(song);
+         if ((rest = db_find(&changed, mpd_song_get_uri(song))) ||
+             (rest = db_find(old, mpd_song_get_uri(song)))) {
+            fprintf(f, "%s\t%s\n", mpd_song_get_uri(song), rest);
+         } else if (!strpbrk(mpd_song_get_uri(song), "\t\n")) {
+            /* new song that kept an old mtime, fetched below */
+            if (count == size) {
+               size = (size?size*2:32);
+               if (!(mtmp = realloc(missing, size * sizeof(char*)))) size = count;
+               else missing = mtmp;
             }
-            if (tokc != found) found = 0;
-            free(cpy);
+            if (count != size && (missing[count] = strdup(mpd_song_get_uri(song)))) ++count;
+            else oom = 1;
          }
       }
+      mpd_entity_free(entity);
+   }
+   if (!mpd_response_finish(mpd->connection))
+      goto mpd_error;
+   if (oom)
+      goto fail;
 
-      free(whole);
-      if (found) return RETURN_OK;
+   if (count) {
+      if (!mpd_command_list_begin(mpd->connection, false))
+         goto mpd_error;
+      for (i = 0; i != count; ++i)
+         mpd_send_list_meta(mpd->connection, missing[i]);
+      if (!MPDRT(mpd_command_list_end(mpd->connection)))
+         goto mpd_error;
+      if (recv_records(&added, &sb) != RETURN_OK)
+         goto fail;
+      for (i = 0; i != added.count; ++i)
+         fprintf(f, "%s\t%s\n", added.uri[i], added.rest[i]);
    }
 
-   return RETURN_FAIL;
-}
+   ret = commit_cache(f, tmp, DB_CACHE);
+   f = NULL;
+   goto fail;
 
-/* now playing */
-static void now_playing(int printimg) {
-   char *cover;
-   struct mpd_song *song = mpd_run_current_song(mpd->connection);
-   if (!song) return;
-   print_song(song, SEPERATOR, 0);
-   if (printimg && (cover = get_cover_art(song))) {
-      printf("%s\n", cover);
-      free(cover);
+mpd_error:
+   MPDERR();
+fail:
+   /* older mpd may refuse modified-since, full sync follows */
+   mpd_connection_clear_error(mpd->connection);
+   if (f) {
+      fclose(f);
+      unlink(tmp);
    }
-   mpd_song_free(song);
+   for (i = 0; i != count; ++i) free(missing[i]);
+   if (missing) free(missing);
+   if (sb.data) free(sb.data);
+   db_free(&changed, 1);
+   db_free(&added, 1);
+   return ret;
 }
 
-/* list queue */
-static int list_queue(int printimg) {
-   unsigned int pos, end, mid;
-   struct mpd_entity *entity;
-   assert(mpd && mpd->connection);
-
-   for (mid = pos = 0, end = MPD_OUTPUT_BUFFER;
-         mpd_send_list_queue_range_meta(mpd->connection, pos, end);
-         pos = end, end *= 2) {
-      while ((entity = mpd_recv_entity(mpd->connection))) {
-         if (mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
-            print_song(mpd_entity_get_song(entity), SEPERATOR, printimg);
-            mid = mpd_song_get_id(mpd_entity_get_song(entity));
+/* bring mirror up to date, returns it opened at first record */
+static FILE* sync_db(void) {
+   FILE *f;
+   struct mpd_stats *dbstats;
+   dbrecords old;
+   unsigned long stamp, since = 0;
+   char *data = NULL;
+   int ret;
+
+   /* resync only when the update time moved */
+   if (!(dbstats = MPDRT(mpd_run_stats(mpd->connection)))) {
+      MPDERR();
+      if ((f = open_cache(DB_CACHE)) && read_db_stamp(f, &since) == RETURN_OK)
+         return f;
+      if (f) fclose(f);
+      return NULL;
+   }
+   stamp = mpd_stats_get_db_update_time(dbstats);
+   mpd_stats_free(dbstats);
+
+   memset(&old, 0, sizeof(dbrecords));
+   if ((f = open_cache(DB_CACHE))) {
+      if (read_db_stamp(f, &since) == RETURN_OK) {
+         if (since == stamp) return f;
+         if ((data = load_db(f, &old)) && db_index(&old) != RETURN_OK) {
+            db_free(&old, 0);
+            free(data);
+            data = NULL;
          }
-         mpd_entity_free(entity);
       }
-      if (end > mid) break;
+      fclose(f);
    }
 
-   if (!mpd_response_finish(mpd->connection))
-      MPDERR();
+   OUT("Syncing database mirror [%lu]", stamp);
+   ret = (data ? update_db(&old, since, stamp) : RETURN_FAIL);
+   if (data) {
+      db_free(&old, 0);
+      free(data);
+   }
+   if (ret != RETURN_OK && write_db(stamp) != RETURN_OK)
+      return NULL;
 
-   mpd->queue.version = mpd_status_get_queue_version(mpd->status);
-   return RETURN_OK;
+   if ((f = open_cache(DB_CACHE)) && read_db_stamp(f, &since) != RETURN_OK) {
+      fclose(f);
+      return NULL;
+   }
+   return f;
 }
 
-/* search queue */
-static struct mpd_song* search_queue(const char *needle) {
-   int exact = 0;
-   unsigned int pos, end, mid;
-   struct mpd_song *song = NULL;
-   struct mpd_entity *entity;
-   assert(mpd && mpd->connection);
+/* join arguments with spaces */
+static char* join_args(int argc, char **argv) {
+   size_t len = 0, i = 0;
+   char *joined;
 
-   for (mid = pos = 0, end = MPD_OUTPUT_BUFFER; !song &&
-         mpd_send_list_queue_range_meta(mpd->connection, pos, end);
-         pos = end, end *= 2) {
-      while (!song && (entity = mpd_recv_entity(mpd->connection))) {
-         if (mpd_entity_get_type(entity) == MPD_ENTITY_TYPE_SONG) {
-            if (!exact && match_song(mpd_entity_get_song(entity), needle, SEPERATOR, &exact) == RETURN_OK) {
-               if (song) mpd_song_free(song);
-               song = mpd_song_dup(mpd_entity_get_song(entity));
-            }
-            mid = mpd_song_get_id(mpd_entity_get_song(entity));
-         }
-         mpd_entity_free(entity);
-      }
-      if (end > mid) break;
-   }
+   for (i = 0; i != argc; ++i) {
+      if (i) len += 1;
+      len += strlen(argv[i]);
+   } len += 2;
 
-   if (!mpd_response_finish(mpd->connection))
-      MPDERR();
+   if (!(joined = calloc(1, len)))
+      return NULL;
 
-   mpd->queue.version = mpd_status_get_queue_version(mpd->status);
-   return song;
+   for (i = 0; i != argc; ++i) {
+      if (i) joined = strncat(joined, " ", len);
+      joined = strncat(joined, argv[i], len);
+   }
+   return joined;
 }
 
-/* update status */
-static void update_status(void) {
-   assert(mpd && mpd->connection);
-   if (mpd->status)    mpd_status_free(mpd->status);
-   if (!(mpd->status = mpd_run_status(mpd->connection)))
-      MPDERR();
-
+/* update state from status */
+static void update_state(void) {
+   assert(mpd && mpd->status);
    mpd->state.id        = mpd_status_get_update_id(mpd->status);
    mpd->state.volume    = mpd_status_get_volume(mpd->status);
    mpd->state.crossfade = mpd_status_get_crossfade(mpd->status);
    mpd->state.queuever  = mpd_status_get_queue_version(mpd->status);
    mpd->state.queuelen  = mpd_status_get_queue_length(mpd->status);
    mpd->state.song      = mpd_status_get_song_id(mpd->status);
+   mpd->state.songpos   = mpd_status_get_song_pos(mpd->status);
    mpd->state.state     = mpd_status_get_state(mpd->status);
 
+   mpd->state.playmode = 0;
    if (mpd_status_get_repeat(mpd->status))
       mpd->state.playmode |= PLAY_REPEAT;
    if (mpd_status_get_random(mpd->status))
@@ -492,7 +2846,7 @@ static void update_status(void) {
    OUT("State [%d]: V:%d CF:%d, Q:%d QL:%d S:%d SP:%d ST:%s", mpd->state.id,
          mpd->state.volume, mpd->state.crossfade,
          mpd->state.queuever, mpd->state.queuelen, mpd->state.song,
-         mpd_status_get_song_pos(mpd->status),
+         mpd->state.songpos,
          mpd->state.state==MPD_STATE_STOP?"STOP":
          mpd->state.state==MPD_STATE_PLAY?"PLAY":
          mpd->state.state==MPD_STATE_PAUSE?"PAUSE":"UNKNOWN");
@@ -503,6 +2857,17 @@ static void update_status(void) {
          mpd->state.playmode & PLAY_CONSUME);
 }
 
+/* update status */
+static void update_status(void) {
+   assert(mpd && mpd->connection);
+   if (mpd->status)    mpd_status_free(mpd->status);
+   if (!(mpd->status = MPDRT(mpd_run_status(mpd->connection)))) {
+      MPDERR();
+      return;
+   }
+   update_state();
+}
+
 /* quit mpd */
 static void quit_mpd(void) {
    assert(mpd);
@@ -526,11 +2891,11 @@ static int init_mpd(void) {
    if (!(mpd = calloc(1, sizeof(mpdclient))))
       goto alloc_fail;
 
-   if (!(mpd->connection = mpd_connection_new(host, mpd_port, MPD_TIMEOUT)) ||
+   if (!(mpd->connection = MPDRT(mpd_connection_new(host, mpd_port, MPD_TIMEOUT))) ||
          mpd_connection_get_error(mpd->connection))
       goto connect_fail;
 
-   if (pass && !mpd_run_password(mpd->connection, pass))
+   if (pass && !MPDRT(mpd_run_password(mpd->connection, pass)))
       goto connect_fail;
 
    mpd->server.version = mpd_connection_get_server_version(mpd->connection);
@@ -550,6 +2915,12 @@ connect_fail:
    return RETURN_FAIL;
 }
 
+/* song added from directory, sorted by disc and track */
+typedef struct addsong {
+   int id;
+   unsigned int disc, track;
+} addsong;
+
 enum {
    ADD_MODE_SEARCH,
    ADD_MODE_PLAYLIST,
@@ -558,20 +2929,10 @@ enum {
 
 int song_compare(const void *a, const void *b)
 {
-   int ret = INT_MAX;
-   struct mpd_song *sa = mpd_run_get_queue_song_id(mpd->connection, *(int*)a);
-   struct mpd_song *sb = mpd_run_get_queue_song_id(mpd->connection, *(int*)b);
-   if (sa && sb) {
-      const char *cta = mpd_song_get_tag(sa, MPD_TAG_TRACK, 0);
-      const char *ctb = mpd_song_get_tag(sb, MPD_TAG_TRACK, 0);
-      int ta = INT_MAX, tb = INT_MAX;
-      if (cta) sscanf(cta, "%d/%*", &ta);
-      if (ctb) sscanf(ctb, "%d/%*", &tb);
-      ret = ta - tb;
-   }
-   if (sa) mpd_song_free(sa);
-   if (sb) mpd_song_free(sb);
-   return ret;
+   const addsong *sa = a, *sb = b;
+   if (sa->disc != sb->disc) return (sa->disc < sb->disc ? -1 : 1);
+   if (sa->track != sb->track) return (sa->track < sb->track ? -1 : 1);
+   return 0;
 }
 
 static void add_from(const char *path, int add_mode, int *found_playlist, int *found_song_id)
@@ -584,6 +2945,7 @@ static void add_from(const char *path, int add_mode, int *found_playlist, int *f
    unsigned int start_pos, small_pos;
    int sub_path_size, did_add_file = 0, contains_playlist = 0, i, id = -1;
    int *song_list = NULL, *old_song_list, song_list_count = 0, song_list_size = 0;
+   addsong *sorted;
    const int song_list_alloc = 32;
 
    if (found_song_id) *found_song_id = -1;
@@ -630,28 +2992,32 @@ static void add_from(const char *path, int add_mode, int *found_playlist, int *f
       }
       closedir(dp);
 
-      /* sort songs */
-      if (song_list) {
-         qsort(song_list, song_list_count, sizeof(int), song_compare);
-
-         /* get song with smallest position */
+      /* fetch sort keys once, then sort songs */
+      if (song_list && (sorted = calloc(song_list_count, sizeof(addsong)))) {
          start_pos = UINT_MAX;
          for (i = 0; i != song_list_count; ++i) {
-            song = mpd_run_get_queue_song_id(mpd->connection, song_list[i]);
+            sorted[i].id = song_list[i];
+            sorted[i].disc = sorted[i].track = UINT_MAX;
+            song = MPDRT(mpd_run_get_queue_song_id(mpd->connection, song_list[i]));
             if (!song) {
                MPDERR();
                continue;
             }
+            sorted[i].disc  = tag_number(mpd_song_get_tag(song, MPD_TAG_DISC, 0));
+            sorted[i].track = tag_number(mpd_song_get_tag(song, MPD_TAG_TRACK, 0));
             small_pos = mpd_song_get_pos(song);
             if (small_pos < start_pos) start_pos = small_pos;
             mpd_song_free(song);
          }
 
+         qsort(sorted, song_list_count, sizeof(addsong), song_compare);
+
          /* do the moving */
          for (i = 0; start_pos != UINT_MAX && i != song_list_count; ++i) {
-            if (!mpd_run_move_id(mpd->connection, song_list[i], start_pos+i))
+            if (!MPDRT(mpd_run_move_id(mpd->connection, sorted[i].id, start_pos+i)))
                MPDERR();
          }
+         free(sorted);
       }
       if (song_list) free(song_list);
    } else {
@@ -670,7 +3036,7 @@ static void add_from(const char *path, int add_mode, int *found_playlist, int *f
 
          if (add_mode == ADD_MODE_PLAYLIST) {
             printf(">> adding playlist: %s\n", path+1+strlen(MUSIC_DIR));
-            if (!mpd_run_load(mpd->connection, path+1+strlen(MUSIC_DIR)))
+            if (!MPDRT(mpd_run_load(mpd->connection, path+1+strlen(MUSIC_DIR))))
                MPDERR();
          }
          did_add_file = 1;
@@ -683,7 +3049,7 @@ static void add_from(const char *path, int add_mode, int *found_playlist, int *f
          if (strcmp(path+strlen(path)-strlen(ext), ext)) continue;
 
          printf(">> adding file: %s\n", path+1+strlen(MUSIC_DIR));
-         if ((id = mpd_run_add_id(mpd->connection, path+1+strlen(MUSIC_DIR))) == -1)
+         if ((id = MPDRT(mpd_run_add_id(mpd->connection, path+1+strlen(MUSIC_DIR)))) == -1)
             MPDERR();
          if (found_song_id) *found_song_id = id;
          did_add_file = 1;
@@ -706,7 +3072,7 @@ FUNC_OPT(opt_add) {
    if (access(path, R_OK) != 0)
       goto access_fail;
 
-   if (!(id = mpd_run_update(mpd->connection, (!strcmp(path, MUSIC_DIR)?NULL:argv[0])))) {
+   if (!(id = MPDRT(mpd_run_update(mpd->connection, (!strcmp(path, MUSIC_DIR)?NULL:argv[0]))))) {
       MPDERR();
       goto fail;
    }
@@ -714,14 +3080,14 @@ FUNC_OPT(opt_add) {
    while (1) {
       unsigned int current_id;
       struct mpd_status *status;
-      enum mpd_idle idle = mpd_run_idle_mask(mpd->connection, MPD_IDLE_UPDATE);
+      enum mpd_idle idle = MPDRT(mpd_run_idle_mask(mpd->connection, MPD_IDLE_UPDATE));
       if (idle == 0) {
          MPDERR();
          goto fail;
       }
 
       /* determine the current "update id" */
-      if (!(status = mpd_run_status(mpd->connection))) {
+      if (!(status = MPDRT(mpd_run_status(mpd->connection)))) {
          MPDERR();
          goto fail;
       }
@@ -746,51 +3112,50 @@ fail:
 
 FUNC_OPT(opt_clear) {
    OUT("clear");
-   if (!mpd_run_clear(mpd->connection))
+   if (!MPDRT(mpd_run_clear(mpd->connection)))
       MPDERR();
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_ls) {
+   int i, printimg = 0;
+   const char *sort = NULL, *group = NULL;
    OUT("ls");
-   list_queue((argc && !strcmp(argv[0], ARG_WITH_COVER))?1:0);
+
+   for (i = 0; i != argc; ++i) {
+      if (!strcmp(argv[i], ARG_WITH_COVER)) printimg = 1;
+      else if (!strcmp(argv[i], ARG_SORT) && i+1 != argc) sort = argv[++i];
+      else if (!strcmp(argv[i], ARG_GROUP_BY) && i+1 != argc) group = argv[++i];
+   }
+
+   if (sort || group) return (list_sorted(sort, group, printimg) == RETURN_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+   list_queue(printimg);
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_index) {
    OUT("index");
-   struct mpd_song *song = mpd_run_current_song(mpd->connection);
+   struct mpd_song *song = MPDRT(mpd_run_current_song(mpd->connection));
    printf("%u\n", (song?mpd_song_get_pos(song)+1:1));
    if (song) mpd_song_free(song);
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_play) {
-   struct mpd_song *song = NULL;
-   size_t len = 0, i = 0;
-   char *search;
+   char *search, *line;
+   int id;
 
-   if (!argc) mpd_send_play(mpd->connection);
+   if (!argc) MPDRT(mpd_send_play(mpd->connection));
    else {
-      for (i = 0; i != argc; ++i) {
-         if (i) len += 1;
-         len += strlen(argv[i]);
-      } len += 2;
-
-      if (!(search = calloc(1, len)))
+      if (!(search = join_args(argc, argv)))
          return EXIT_FAILURE;
 
-      for (i = 0; i != argc; ++i) {
-         if (i) search = strncat(search, " ", len);
-         search = strncat(search, argv[i], len);
-      }
-
       OUT("play: %s", search);
-      if ((song = search_queue(search))) {
-         print_song(song, SEPERATOR, 0);
-         if (!mpd_send_play_id(mpd->connection, mpd_song_get_id(song)))
+      if ((id = search_queue(search, &line)) >= 0) {
+         print_line(line, NULL);
+         if (!MPDRT(mpd_send_play_id(mpd->connection, id)))
             MPDERR();
-         mpd_song_free(song);
+         free(line);
       } else {
          printf("no match for: %s\n", search);
       }
@@ -806,64 +3171,280 @@ fail:
 
 FUNC_OPT(opt_stop) {
    OUT("stop");
-   mpd_send_stop(mpd->connection);
+   MPDRT(mpd_send_stop(mpd->connection));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_pause) {
    OUT("pause");
-   mpd_send_pause(mpd->connection, !argc?1:strtol(argv[0], NULL, 10));
+   MPDRT(mpd_send_pause(mpd->connection, !argc?1:strtol(argv[0], NULL, 10)));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_toggle) {
    OUT("toggle");
-   mpd_send_toggle_pause(mpd->connection);
+   MPDRT(mpd_send_toggle_pause(mpd->connection));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_next) {
    OUT("next");
-   mpd_send_next(mpd->connection);
+   MPDRT(mpd_send_next(mpd->connection));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_prev) {
    OUT("previous");
-   mpd_send_previous(mpd->connection);
+   MPDRT(mpd_send_previous(mpd->connection));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_repeat) {
    OUT("repeat");
-   mpd_send_repeat(mpd->connection, !argc?1:strtol(argv[0], NULL, 10));
+   MPDRT(mpd_send_repeat(mpd->connection, !argc?1:strtol(argv[0], NULL, 10)));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_random) {
    OUT("random");
-   mpd_send_random(mpd->connection, !argc?1:strtol(argv[0], NULL, 10));
+   MPDRT(mpd_send_random(mpd->connection, !argc?1:strtol(argv[0], NULL, 10)));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_single) {
    OUT("single");
-   mpd_send_single(mpd->connection, !argc?1:strtol(argv[0], NULL, 10));
+   MPDRT(mpd_send_single(mpd->connection, !argc?1:strtol(argv[0], NULL, 10)));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_consume) {
    OUT("consume");
-   mpd_send_consume(mpd->connection, !argc?1:strtol(argv[0], NULL, 10));
+   MPDRT(mpd_send_consume(mpd->connection, !argc?1:strtol(argv[0], NULL, 10)));
    return EXIT_SUCCESS;
 }
 
 FUNC_OPT(opt_crossfade) {
    assert(argc);
    OUT("crossfade");
-   mpd_send_crossfade(mpd->connection, strtol(argv[0], NULL, 10));
+   MPDRT(mpd_send_crossfade(mpd->connection, strtol(argv[0], NULL, 10)));
    return EXIT_SUCCESS;
 }
+
+/* status and current song in one round-trip */
+static struct mpd_song* watch_state(void) {
+   struct mpd_song *song = NULL;
+   if (!mpd_command_list_begin(mpd->connection, true) ||
+       !mpd_send_status(mpd->connection) ||
+       !mpd_send_current_song(mpd->connection) ||
+       !MPDRT(mpd_command_list_end(mpd->connection)))
+      goto mpd_error;
+
+   if (!get_status() || !mpd_response_next(mpd->connection))
+      goto mpd_error;
+   update_state();
+
+   song = mpd_recv_song(mpd->connection);
+   stats_song(song);
+   if (!mpd_response_finish(mpd->connection))
+      goto mpd_error;
+   return song;
+
+mpd_error:
+   MPDERR();
+   if (song) mpd_song_free(song);
+   return NULL;
+}
+
+/* reconnect after mpd restart or dropped idle, backing off between attempts */
+static int reconnect_mpd(void) {
+   unsigned int delay = 1;
+   for (;;) {
+      sleep(delay);
+      if (init_mpd() == RETURN_OK) return RETURN_OK;
+      if (!mpd) return RETURN_FAIL;
+      if ((delay *= 2) > RECONNECT_MAX) delay = RECONNECT_MAX;
+   }
+}
+
+FUNC_OPT(opt_watch) {
+   int printimg = (argc && !strcmp(argv[0], ARG_WITH_COVER));
+   int lsong = -2;
+   char *sline, *cover = NULL, line[LINE_MAX], lline[LINE_MAX];
+   struct mpd_song *song;
+   OUT("watch");
+
+   memset(lline, 0, sizeof(lline));
+   for (;;) {
+      song = watch_state();
+      if (mpd_connection_get_error(mpd->connection) != MPD_ERROR_SUCCESS) {
+         /* status line must not freeze on the last state while mpd is gone */
+         if (strcmp(lline, "[disconnected]")) {
+            printf("[disconnected]\n");
+            fflush(stdout);
+            strcpy(lline, "[disconnected]");
+         }
+         if (reconnect_mpd() != RETURN_OK) break;
+         lsong = -2;
+         continue;
+      }
+
+      /* cover only changes with the song */
+      if (printimg && mpd->state.song != lsong) {
+         if (cover) free(cover);
+         cover = get_cover_art(song);
+      }
+      lsong = mpd->state.song;
+
+      sline = song_line(song);
+      snprintf(line, sizeof(line)-1, "%s [%s] [%d%%] [%c%c%c%c]",
+            (sline?sline:""),
+            mpd->state.state==MPD_STATE_PLAY?"playing":
+            mpd->state.state==MPD_STATE_PAUSE?"paused":"stopped",
+            mpd->state.volume,
+            mpd->state.playmode & PLAY_REPEAT  ? 'r' : '-',
+            mpd->state.playmode & PLAY_RANDOM  ? 'z' : '-',
+            mpd->state.playmode & PLAY_SINGLE  ? 's' : '-',
+            mpd->state.playmode & PLAY_CONSUME ? 'c' : '-');
+      if (song) mpd_song_free(song);
+
+      /* print only when something visible changed */
+      if (strcmp(line, lline)) {
+         if (printimg && cover) printf("IMG:%s\t", cover);
+         printf("%s\n", line);
+         fflush(stdout);
+         strcpy(lline, line);
+      }
+
+      /* failed idle leaves the error set, next round reconnects */
+      if (!MPDRT(mpd_run_idle_mask(mpd->connection,
+                  MPD_IDLE_PLAYER|MPD_IDLE_OPTIONS|MPD_IDLE_MIXER)))
+         MPDERR();
+   }
+
+   if (cover) free(cover);
+   return EXIT_FAILURE;
+}
+
+FUNC_OPT(opt_find) {
+   FILE *db;
+   char *needle, *line = NULL, *tab, *key, **uris = NULL, **tmp;
+   size_t size = 0, count = 0, alloc = 0, i;
+   ssize_t len;
+   mpdquery query;
+   int ret = EXIT_SUCCESS;
+
+   if (!(needle = join_args(argc, argv)))
+      return EXIT_FAILURE;
+
+   OUT("find: %s", needle);
+   stats_phase(PHASE_COMMAND);
+   if (init_query(&query, needle) == RETURN_OK && !query.tokc)
+      ERR("Empty query, nothing added");
+   if (!query.tokc || !(db = sync_db())) {
+      free_query(&query);
+      free(needle);
+      return EXIT_FAILURE;
+   }
+   stats_phase(PHASE_MIRROR);
+
+   while ((len = getline(&line, &size, db)) > 0) {
+      if (line[len-1] == '\n') line[len-1] = 0;
+      if (!(tab = strchr(line, '\t')) || !(key = strchr(tab+1, '\t'))) continue;
+      *tab = 0; *key++ = 0;
+      if (match_line(&query, tab+1, key, NULL) != RETURN_OK) continue;
+
+      if (count == alloc) {
+         alloc = (alloc?alloc*2:32);
+         if (!(tmp = realloc(uris, alloc * sizeof(char*)))) {
+            ret = EXIT_FAILURE;
+            break;
+         }
+         uris = tmp;
+      }
+      if (!(uris[count] = strdup(line))) {
+         ret = EXIT_FAILURE;
+         break;
+      }
+      printf("%s\n", tab+1);
+      ++count;
+   }
+   if (line) free(line);
+   fclose(db);
+
+   /* enqueue all results in one command list */
+   stats_phase(PHASE_COMMAND);
+   if (ret != EXIT_SUCCESS) {
+      ERR("Could not collect matches, nothing added");
+   } else if (count) {
+      if (!mpd_command_list_begin(mpd->connection, false))
+         MPDERR();
+      for (i = 0; i != count; ++i)
+         mpd_send_add_id(mpd->connection, uris[i]);
+      if (!MPDRT(mpd_command_list_end(mpd->connection)) ||
+          !mpd_response_finish(mpd->connection)) {
+         MPDERR();
+         ret = EXIT_FAILURE;
+      } else printf(">> added %zu song(s)\n", count);
+      stats_phase(PHASE_EDIT);
+   } else {
+      printf("no match for: %s\n", needle);
+   }
+
+   for (i = 0; i != count; ++i) free(uris[i]);
+   if (uris) free(uris);
+   free_query(&query);
+   free(needle);
+   return ret;
+}
+
+FUNC_OPT(opt_keep) {
+   char *needle;
+   int ret;
+   if (!(needle = join_args(argc, argv)))
+      return EXIT_FAILURE;
+   OUT("keep: %s", needle);
+   ret = filter_queue(needle, 1);
+   free(needle);
+   return (ret == RETURN_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+FUNC_OPT(opt_drop) {
+   char *needle;
+   int ret;
+   if (!(needle = join_args(argc, argv)))
+      return EXIT_FAILURE;
+   OUT("drop: %s", needle);
+   ret = filter_queue(needle, 0);
+   free(needle);
+   return (ret == RETURN_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+FUNC_OPT(opt_sync) {
+   char path[PATH_MAX], *dirc, **uris;
+   size_t count = 0, i;
+   int ret;
+
+   OUT("sync: %s", argv[0]);
+   snprintf(path, PATH_MAX-1, "%s/%s", MUSIC_DIR, argv[0]);
+   if (!(dirc = strdup(argv[0])))
+      return EXIT_FAILURE;
+
+   if (!(uris = read_playlist(path, dirname(dirc), &count))) {
+      ERR("Cannot read playlist: %s", path);
+      free(dirc);
+      return EXIT_FAILURE;
+   }
+
+   /* empty playlist clears the queue, only when asked for */
+   if (!count && !(argc > 1 && !strcmp(argv[1], ARG_FORCE))) {
+      ERR("Playlist has no entries, give "ARG_FORCE" to clear the queue: %s", path);
+      ret = RETURN_FAIL;
+   } else ret = sync_queue(uris, count);
+   for (i = 0; i != count; ++i) free(uris[i]);
+   free(uris);
+   free(dirc);
+   return (ret == RETURN_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
 #undef FUNC_OPT
 
 static void usage(char *name) {
@@ -874,9 +3455,38 @@ static void usage(char *name) {
    printf("]\n");
    printf("     - `%s "ARG_WITH_COVER"` to print path to cover art for playing song\n", basename(name));
    printf("     - `%s ls "ARG_WITH_COVER"` to print paths to cover art as well\n", basename(name));
+   printf("     - `%s ls "ARG_SORT" artist,album,disc,track "ARG_GROUP_BY" album` to sort and collapse listing\n", basename(name));
+   printf("     - `%s watch "ARG_WITH_COVER"` to include cover art on each status line\n", basename(name));
+   printf("     - `"ARG_FORMAT" '%%artist%% - %%title%% [%%track%%]'` anywhere to change song line format\n");
+   printf("     - `"ARG_STATS"` anywhere to print counters and timings as json to stderr on exit\n");
    exit(EXIT_FAILURE);
 }
 
+/* remove flag from argv, returns 1 if it was there */
+static int take_flag(int *argc, char **argv, const char *flag) {
+   int i, found = 0;
+   for (i = 1; i < *argc; ++i) {
+      if (strcmp(argv[i], flag)) continue;
+      memmove(&argv[i], &argv[i+1], (*argc-i) * sizeof(char*));
+      --*argc; --i; found = 1;
+   }
+   return found;
+}
+
+/* remove flag and its value from argv, returns the value */
+static char* take_value(int *argc, char **argv, const char *flag) {
+   int i;
+   char *value;
+   for (i = 1; i+1 < *argc; ++i) {
+      if (strcmp(argv[i], flag)) continue;
+      value = argv[i+1];
+      memmove(&argv[i], &argv[i+2], (*argc-i-1) * sizeof(char*));
+      *argc -= 2;
+      return value;
+   }
+   return NULL;
+}
+
 static void usage2(char *name, const mpdopt *opt)
 {
    printf("%s: %s takes %d argument(s)\n", basename(name), opt->arg, opt->argc);
@@ -884,7 +3494,17 @@ static void usage2(char *name, const mpdopt *opt)
 }
 
 int main(int argc, char **argv) {
-   int o;
+   int o, ret = EXIT_SUCCESS;
+   char *fmt;
+
+   clock_gettime(CLOCK_MONOTONIC, &stats.mark);
+   if ((stats.enabled = take_flag(&argc, argv, ARG_STATS)))
+      atexit(print_stats);
+   if ((fmt = take_value(&argc, argv, ARG_FORMAT))) {
+      if (!(format = parse_format(fmt)))
+         goto fail;
+      formatHash = _hash(fmt);
+   }
 
    if (argc >= 2 && strcmp(argv[1], ARG_WITH_COVER)) {
       for (o = 0; opts[o].arg && strcmp(argv[1], opts[o].arg); ++o);
@@ -895,14 +3515,17 @@ int main(int argc, char **argv) {
 
    if (init_mpd() != RETURN_OK)
       goto fail;
+   stats_phase(PHASE_CONNECT);
 
    if (argc >= 2 && strcmp(argv[1], ARG_WITH_COVER)) {
       for (o = 0; opts[o].arg && strcmp(argv[1], opts[o].arg); ++o);
-      if (opts[o].func) opts[o].func(argc-2, argv+2);
+      if (opts[o].func) ret = opts[o].func(argc-2, argv+2);
    } else now_playing((argc>=2 && !strcmp(argv[1], ARG_WITH_COVER)));
+   stats_phase(PHASE_COMMAND);
 
-   quit_mpd();
-   return EXIT_SUCCESS;
+   if (mpd) quit_mpd();
+   stats_phase(PHASE_QUIT);
+   return ret;
 
 fail:
    return EXIT_FAILURE;